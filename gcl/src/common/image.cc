@@ -6,6 +6,88 @@
 
 namespace shrtool {
 
+void image::make_float_cache(texel_layout layout)
+{
+    cache_layout_ = layout;
+    cache_format_ = format_float;
+    mip_cache_.clear();
+    packed_cache_.clear();
+    float_cache_.assign(cache_size(0), fcolor());
+
+    for(size_t t = 0; t < height_; t++)
+    for(size_t l = 0; l < width_; l++)
+        float_cache_[texel_offset(l, t, 0)] = pixel(l, t);
+}
+
+// rounded average of four colors, two channels at a time
+static color average_rgba8(color c0, color c1, color c2, color c3)
+{
+    uint32_t rb = 0x00020002, ga = 0x00020002;
+    for(uint32_t c : { c0.data.rgba, c1.data.rgba, c2.data.rgba, c3.data.rgba }) {
+        rb += c & 0x00ff00ff;
+        ga += (c >> 8) & 0x00ff00ff;
+    }
+
+    return color(((rb >> 2) & 0x00ff00ff) | ((ga << 6) & 0xff00ff00));
+}
+
+void image::make_mipmaps(texel_layout layout, texel_format format)
+{
+    if(format == format_rgba8) {
+        cache_layout_ = layout;
+        cache_format_ = format_rgba8;
+        std::vector<fcolor>().swap(float_cache_);
+        mip_cache_.clear();
+
+        packed_cache_.assign(1, std::vector<color>(cache_size(0)));
+        for(size_t t = 0; t < height_; t++)
+        for(size_t l = 0; l < width_; l++)
+            packed_cache_[0][texel_offset(l, t, 0)] = pixel(l, t);
+
+        for(size_t level = 1; level_width(level) >= 2 &&
+                level_height(level) >= 2; level++) {
+            const std::vector<color>& src = packed_cache_.back();
+            size_t w = level_width(level), h = level_height(level);
+
+            std::vector<color> dst(cache_size(level));
+            for(size_t y = 0; y < h; y++)
+            for(size_t x = 0; x < w; x++) {
+                size_t l = x * 2, t = y * 2, s = level - 1;
+                dst[texel_offset(x, y, level)] = average_rgba8(
+                    src[texel_offset(l, t, s)],
+                    src[texel_offset(l + 1, t, s)],
+                    src[texel_offset(l, t + 1, s)],
+                    src[texel_offset(l + 1, t + 1, s)]);
+            }
+
+            packed_cache_.push_back(std::move(dst));
+        }
+
+        return;
+    }
+
+    make_float_cache(layout);
+
+    for(size_t level = 1; level_width(level) >= 2 &&
+            level_height(level) >= 2; level++) {
+        const std::vector<fcolor>& src =
+            level > 1 ? mip_cache_.back() : float_cache_;
+        size_t w = level_width(level), h = level_height(level);
+
+        std::vector<fcolor> dst(cache_size(level));
+        for(size_t y = 0; y < h; y++)
+        for(size_t x = 0; x < w; x++) {
+            size_t l = x * 2, t = y * 2, s = level - 1;
+            dst[texel_offset(x, y, level)] =
+                (src[texel_offset(l, t, s)] + src[texel_offset(l + 1, t, s)] +
+                src[texel_offset(l, t + 1, s)] +
+                src[texel_offset(l + 1, t + 1, s)]) * 0.25f;
+        }
+
+        mip_cache_.push_back(std::move(dst));
+    }
+}
+
 void image::copy_pixel(size_t offx, size_t offy, size_t w, size_t h,
         image& dest, size_t dest_x, size_t dest_y) const {
     if(offx + w > width() || offy + h > height() ||
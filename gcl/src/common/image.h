@@ -11,6 +11,28 @@
 
 namespace shrtool {
 
+/*
+ * Layout of the texels that quad() samples. layout_tiled stores 4x4 blocks
+ * one after another, and Z-order within each, so that any aligned 2x2 quad is
+ * contiguous (64 bytes of fcolor, which the vector doesn't align to a cache
+ * line), and that neighbours are as close vertically as horizontally whatever
+ * the direction textures are walked in.
+ */
+enum texel_layout {
+    layout_linear,
+    layout_tiled,
+};
+
+/*
+ * Format of the texels that quad() samples. format_rgba8 keeps them packed
+ * as color, a quarter of the memory of fcolor, for samplers that filter in
+ * fixed point.
+ */
+enum texel_format {
+    format_float,
+    format_rgba8,
+};
+
 class image {
     friend struct image_geometry_helper__;
 
@@ -19,8 +41,22 @@ class image {
 
     std::vector<color> underlying_;
     std::vector<fcolor> float_cache_;
+    // level 0 is float_cache_, level i is mip_cache_[i - 1]
+    std::vector<std::vector<fcolor>> mip_cache_;
+    // every level, with format_rgba8
+    std::vector<std::vector<color>> packed_cache_;
+    texel_layout cache_layout_ = layout_linear;
+    texel_format cache_format_ = format_float;
     color* data_ = nullptr;
 
+    // padded to whole blocks when tiled
+    size_t cache_size(size_t level) const {
+        if(cache_layout_ == layout_linear)
+            return level_width(level) * level_height(level);
+        return ((level_width(level) + 3) & ~size_t(3)) *
+            ((level_height(level) + 3) & ~size_t(3));
+    }
+
 public:
     typedef color* iterator;
     typedef color const* const_iterator;
@@ -75,17 +111,79 @@ public:
         return data()[t * width_ + l];
     }
 
+    const std::vector<fcolor>& cache_of(size_t level, const fcolor*) const {
+        return level ? mip_cache_[level - 1] : float_cache_;
+    }
+
+    const std::vector<color>& cache_of(size_t level, const color*) const {
+        return packed_cache_[level];
+    }
+
+    // Texel is fcolor for format_float, color for format_rgba8
+    template<typename Texel>
     const void quad(size_t l, size_t t,
-            fcolor& c00, fcolor& c10, fcolor& c01, fcolor& c11) const {
+            Texel& c00, Texel& c10, Texel& c01, Texel& c11,
+            size_t level = 0) const {
 #if _DEBUG
-        GUARD_(!float_cache_.empty());
+        GUARD_(level < levels());
 #endif
-        l += t * width_;
+        const std::vector<Texel>& cache =
+            cache_of(level, static_cast<const Texel*>(nullptr));
+
+        if(cache_layout_ == layout_linear) {
+            size_t w = level_width(level);
+            l += t * w;
+
+            c00 = cache[l];
+            c10 = cache[l + 1];
+            c01 = cache[l + w];
+            c11 = cache[l + w + 1];
+            return;
+        }
+
+        size_t o = texel_offset(l, t, level);
+        if(!(l & 1) && !(t & 1)) {
+            // an aligned quad is contiguous
+            c00 = cache[o];
+            c10 = cache[o + 1];
+            c01 = cache[o + 2];
+            c11 = cache[o + 3];
+            return;
+        }
+
+        c00 = cache[o];
+        c10 = cache[texel_offset(l + 1, t, level)];
+        c01 = cache[texel_offset(l, t + 1, level)];
+        c11 = cache[texel_offset(l + 1, t + 1, level)];
+    }
+
+    // offset of a texel in the cache of a level, see texel_layout
+    size_t texel_offset(size_t l, size_t t, size_t level) const {
+        if(cache_layout_ == layout_linear)
+            return t * level_width(level) + l;
 
-        c00 = float_cache_[l];
-        c10 = float_cache_[l + 1];
-        c01 = float_cache_[l + width_];
-        c11 = float_cache_[l + width_ + 1];
+        size_t blocks_x = (level_width(level) + 3) >> 2;
+        size_t block = (t >> 2) * blocks_x + (l >> 2);
+        size_t z = (l & 1) | (t & 1) << 1 | (l & 2) << 1 | (t & 2) << 2;
+        return block << 4 | z;
+    }
+
+    texel_layout cache_layout() const { return cache_layout_; }
+    texel_format cache_format() const { return cache_format_; }
+
+    // levels that quad() can read, 0 without a cache
+    size_t levels() const {
+        if(cache_format_ == format_rgba8)
+            return packed_cache_.size();
+        return float_cache_.empty() ? 0 : mip_cache_.size() + 1;
+    }
+
+    size_t level_width(size_t level) const {
+        return std::max<size_t>(width_ >> level, 1);
+    }
+
+    size_t level_height(size_t level) const {
+        return std::max<size_t>(height_ >> level, 1);
     }
 
     void resize(size_t w, size_t h) {
@@ -104,10 +202,19 @@ public:
     void copy_pixel(size_t offx, size_t offy, size_t w, size_t h,
             image& dest, size_t dest_x, size_t dest_y) const;
 
-    void make_float_cache() {
-        float_cache_.resize(width_ * height_);
-        std::copy(begin(), end(), float_cache_.begin());
-    }
+    /*
+     * Caches are only read through quad(), so their layout is free to
+     * differ from the row-major pixels that begin(), end() and pixel() see.
+     */
+    void make_float_cache(texel_layout layout = layout_linear);
+
+    /*
+     * Makes the cache and a chain of levels, each a 2x2 box filter of the one
+     * before, down to the last level that is still at least 2x2. Caches of
+     * the other format are released.
+     */
+    void make_mipmaps(texel_layout layout = layout_linear,
+            texel_format format = format_float);
 
     /* Many cubemap images have layouts as such:
      *    +Y
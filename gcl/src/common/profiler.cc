@@ -0,0 +1,103 @@
+#include <cstdlib>
+#include <limits>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+
+#include "profiler.h"
+#include "logger.h"
+
+#define PROFILE_ENV "SHRTOOL_PROFILE"
+
+namespace shrtool {
+
+static bool profile_env_enabled()
+{
+    char* env = std::getenv(PROFILE_ENV);
+    return env && *env && *env != '0';
+}
+
+bool profiler::enabled_ = profile_env_enabled();
+
+// created before any thread can race on it
+static profiler& regius_profiler = profiler::inst();
+
+size_t profiler::zone(const std::string& name)
+{
+    profiler& p = inst();
+    std::lock_guard<std::mutex> guard(p.lock_);
+
+    auto i = std::find(p.zones_.begin(), p.zones_.end(), name);
+    if(i != p.zones_.end())
+        return i - p.zones_.begin();
+
+    p.zones_.push_back(name);
+    return p.zones_.size() - 1;
+}
+
+profiler::thread_buffer& profiler::local_buffer()
+{
+    static thread_local thread_buffer* local = nullptr;
+    if(local) return *local;
+
+    profiler& p = inst();
+    std::lock_guard<std::mutex> guard(p.lock_);
+
+    // owned by the profiler, so that samples outlive their thread
+    p.buffers_.emplace_back(new thread_buffer);
+    local = p.buffers_.back().get();
+    return *local;
+}
+
+void profiler::record(size_t zone, double ms)
+{
+    thread_buffer& b = local_buffer();
+    std::lock_guard<std::mutex> guard(b.lock);
+    b.samples.push_back(sample { zone, ms });
+}
+
+void profiler::report()
+{
+    struct summary {
+        size_t count = 0;
+        double min = std::numeric_limits<double>::max();
+        double max = 0;
+        double sum = 0;
+    };
+
+    profiler& p = regius_profiler;
+    std::lock_guard<std::mutex> guard(p.lock_);
+    std::vector<summary> summaries(p.zones_.size());
+    std::vector<sample> samples;
+
+    for(auto& b : p.buffers_) {
+        {
+            std::lock_guard<std::mutex> buffer_guard(b->lock);
+            samples.swap(b->samples);
+        }
+
+        for(const sample& s : samples) {
+            summary& sm = summaries[s.zone];
+            sm.count += 1;
+            sm.min = std::min(sm.min, s.ms);
+            sm.max = std::max(sm.max, s.ms);
+            sm.sum += s.ms;
+        }
+
+        samples.clear();
+    }
+
+    for(size_t z = 0; z < summaries.size(); z++) {
+        const summary& sm = summaries[z];
+        if(!sm.count) continue;
+
+        std::ostringstream ss;
+        ss << std::fixed << std::setprecision(3)
+            << std::left << std::setw(12) << p.zones_[z] << std::right
+            << " min " << sm.min << " ms, avg " << sm.sum / sm.count
+            << " ms, max " << sm.max << " ms (" << sm.count << " samples)";
+        info_log << ss.str() << std::endl;
+    }
+}
+
+}
@@ -0,0 +1,89 @@
+#ifndef PROFILER_H_INCLUDED
+#define PROFILER_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+
+#include "singleton.h"
+
+namespace shrtool {
+
+/*
+ * Zones are named spans of code, and every time one is left its duration is
+ * appended to a buffer owned by the calling thread, so that threads never
+ * wait for each other. report() collects the buffers of all threads and logs
+ * min/avg/max of every zone since the previous report.
+ *
+ * Profiling is disabled unless SHRTOOL_PROFILE is set to non-zero or enable()
+ * is called. A disabled zone costs a test of a flag, and with
+ * SHRTOOL_NO_PROFILE defined zones are not compiled at all.
+ */
+class profiler : public generic_singleton<profiler> {
+public:
+    typedef std::chrono::steady_clock clock_type;
+
+    struct sample {
+        size_t zone;
+        double ms;
+    };
+
+    struct thread_buffer {
+        std::mutex lock;
+        std::vector<sample> samples;
+    };
+
+private:
+    std::mutex lock_;
+    std::vector<std::string> zones_;
+    std::vector<std::shared_ptr<thread_buffer>> buffers_;
+
+    static bool enabled_;
+
+public:
+    static bool enabled() { return enabled_; }
+    static void enable(bool e = true) { enabled_ = e; }
+
+    static size_t zone(const std::string& name);
+    static void record(size_t zone, double ms);
+    static void report();
+
+    static thread_buffer& local_buffer();
+};
+
+class scoped_timer {
+    size_t zone_;
+    bool active_;
+    profiler::clock_type::time_point begin_;
+
+public:
+    scoped_timer(size_t zone) : zone_(zone), active_(profiler::enabled()) {
+        if(active_) begin_ = profiler::clock_type::now();
+    }
+
+    ~scoped_timer() {
+        if(!active_) return;
+        std::chrono::duration<double, std::milli> d =
+            profiler::clock_type::now() - begin_;
+        profiler::record(zone_, d.count());
+    }
+};
+
+#define PROFILE_CAT__(a, b) a##b
+#define PROFILE_CAT_(a, b) PROFILE_CAT__(a, b)
+
+#ifndef SHRTOOL_NO_PROFILE
+#define PROFILE_ZONE(name) \
+    static const size_t PROFILE_CAT_(profile_zone_, __LINE__) = \
+        ::shrtool::profiler::zone(name); \
+    ::shrtool::scoped_timer PROFILE_CAT_(profile_timer_, __LINE__)( \
+        PROFILE_CAT_(profile_zone_, __LINE__))
+#else
+#define PROFILE_ZONE(name)
+#endif
+
+}
+
+#endif // PROFILER_H_INCLUDED
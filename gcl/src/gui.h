@@ -12,6 +12,7 @@
 #include <SDL2/SDL.h>
 
 #include "common/singleton.h"
+#include "common/profiler.h"
 
 #define SDL_USEREVENT_REPAINT 0
 
@@ -127,6 +128,8 @@ public:
                 if(std::chrono::duration_cast<
                         std::chrono::seconds>(dur).count() >= 1) {
                     std::cout << "FPS: " << fps_counter << std::endl;
+                    if(shrtool::profiler::enabled())
+                        shrtool::profiler::report();
                     fps_counter = 0;
                     last_fc_time = std::chrono::system_clock::now();
                 }
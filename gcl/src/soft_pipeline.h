@@ -0,0 +1,1721 @@
+#ifndef SOFT_PIPELINE_H_INCLUDED
+#define SOFT_PIPELINE_H_INCLUDED
+
+#include <vector>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include "common/exception.h"
+#include "common/matrix.h"
+#include "common/mesh.h"
+#include "common/image.h"
+#include "common/profiler.h"
+
+#include "omp.h"
+
+namespace gcl {
+
+namespace math = shrtool::math;
+
+using shrtool::color;
+using shrtool::fcolor;
+using shrtool::image;
+using shrtool::mesh_indexed;
+using shrtool::restriction_error;
+
+////////////////////////////////////////////////////////////////////////////////
+// structures
+
+enum depth_func {
+    depth_never,
+    depth_less,
+    depth_lequal,
+    depth_equal,
+    depth_greater,
+    depth_gequal,
+    depth_notequal,
+    depth_always,
+};
+
+/*
+ * In deferred shading, the rasterizer only records the triangle and the
+ * barycentrics that survive the depth test in each pixel, and every pixel is
+ * shaded once afterwards by shade_visibility(), whatever the overdraw.
+ */
+enum shading_mode {
+    shading_immediate,
+    shading_deferred,
+};
+
+struct visibility {
+    static const uint32_t none = UINT32_MAX;
+
+    uint32_t triangle;
+    float coef[2];
+};
+
+class framebuffer;
+
+struct constants {
+    int viewport_w;
+    int viewport_h;
+    framebuffer* target;
+    depth_func depth_test = depth_less;
+    bool depth_write = true;
+    shading_mode shading = shading_immediate;
+};
+
+/*
+ * A program binds shaders to the pipeline at compile time. VS is called with
+ * the VertexIn stream and a range of it, and writes one VertexOut per vertex
+ * in clip space. FS is called with an interpolated VertexOut and returns its
+ * color. Both get the Uniforms, and are plain functors so that they are
+ * inlined into the stages that call them.
+ *
+ * FS also gets ddx and ddy, the screen-space gradients of the interpolants,
+ * that is of attributes divided by w and of scrpos[3] = 1 / w. The gradient
+ * of an attribute a itself is then (ddx.a - a * ddx.scrpos[3]) / scrpos[3],
+ * which a shader only computes for what it needs, such as texture LOD.
+ *
+ * Besides value_type and the position scrpos, VertexOut must provide:
+ *
+ *  - scale_attributes(k), which multiplies every other attribute by k;
+ *  - lerp(a, b, t), to make the vertices of clipped polygons;
+ *  - combine(v0, c0, v1, c1, v2, c2) and +=, which are linear in every
+ *    component, to set up and step interpolants in screen space;
+ *  - correct_perspective(), which turns such an interpolant into attributes;
+ *  - from_coef(v0, c0, v1, c1, v2, c2), to interpolate a single fragment.
+ */
+template<typename VertexIn, typename VertexOut, typename Uniforms,
+        typename VS, typename FS>
+struct program {
+    typedef VertexIn vertex_in_type;
+    typedef VertexOut vertex_out_type;
+    typedef Uniforms uniforms_type;
+    typedef typename VertexOut::value_type value_type;
+
+    Uniforms uniforms;
+    VS vertex_shader;
+    FS fragment_shader;
+};
+
+/*
+ * The pipeline is templated on the scalar type T of vertex attributes and
+ * shading. It runs on float; double is kept as a reference to compare with.
+ */
+template<typename T>
+struct basic_vertex_in {
+    math::col<T, 4> position;
+    math::col<T, 3> normal;
+    math::col<T, 3> uvs;
+};
+
+typedef basic_vertex_in<double> vertex_in;
+typedef basic_vertex_in<float> fvertex_in;
+
+/*
+ * Vertex inputs as structure of arrays in single precision, so that
+ * consecutive vertices can be transformed in SIMD lanes.
+ */
+struct vertex_stream {
+    std::vector<float> position[4];
+    std::vector<float> normal[3];
+    std::vector<float> uvs[3];
+
+    size_t size() const { return position[0].size(); }
+
+    template<typename T>
+    void push_back(const basic_vertex_in<T>& in) {
+        for(size_t i = 0; i < 4; i++)
+            position[i].push_back(in.position[i]);
+        for(size_t i = 0; i < 3; i++) {
+            normal[i].push_back(in.normal[i]);
+            uvs[i].push_back(in.uvs[i]);
+        }
+    }
+};
+
+/*
+ * A mesh_indexed indexes positions, normals and uvs separately. Every
+ * distinct combination of the three becomes one vertex of the stream, so it
+ * is transformed exactly once, and triangles refer to it through indices.
+ */
+struct indexed_stream {
+    vertex_stream vertices;
+    std::vector<uint32_t> indices;
+
+    static indexed_stream from_mesh(const mesh_indexed& m) {
+        typedef std::tuple<size_t, size_t, size_t> key_type;
+
+        indexed_stream is;
+        std::map<key_type, uint32_t> remap;
+
+        for(size_t i = 0; i < m.vertices(); i++) {
+            key_type key(
+                m.positions.indices[i],
+                m.has_normals() ? m.normals.indices[i] : 0,
+                m.has_uvs() ? m.uvs.indices[i] : 0);
+
+            auto r = remap.insert(std::make_pair(key,
+                        uint32_t(is.vertices.size())));
+            if(r.second) {
+                is.vertices.push_back(vertex_in {
+                        m.positions[i],
+                        m.has_normals() ? m.normals[i] : math::col3(),
+                        m.has_uvs() ? m.uvs[i] : math::col3(),
+                    });
+            }
+
+            is.indices.push_back(r.first->second);
+        }
+
+        return is;
+    }
+};
+
+template<typename T>
+struct basic_vertex_out {
+    typedef T value_type;
+
+    math::col<T, 4> scrpos;
+    math::col<T, 4> worldpos;
+    math::col<T, 3> normal;
+    math::col<T, 3> uvs;
+
+    static basic_vertex_out combine(
+            const basic_vertex_out& v0, T c0,
+            const basic_vertex_out& v1, T c1,
+            const basic_vertex_out& v2, T c2) {
+        basic_vertex_out o;
+
+        o.scrpos = v0.scrpos * c0 + v1.scrpos * c1 + v2.scrpos * c2;
+        o.worldpos = v0.worldpos * c0 + v1.worldpos * c1 + v2.worldpos * c2;
+        o.normal = v0.normal * c0 + v1.normal * c1 + v2.normal * c2;
+        o.uvs = v0.uvs * c0 + v1.uvs * c1 + v2.uvs * c2;
+
+        return o;
+    }
+
+    static basic_vertex_out from_coef(
+            const basic_vertex_out& v0, T c0,
+            const basic_vertex_out& v1, T c1,
+            const basic_vertex_out& v2, T c2) {
+        basic_vertex_out o = combine(v0, c0, v1, c1, v2, c2);
+        o.correct_perspective();
+        return o;
+    }
+
+    basic_vertex_out& operator+=(const basic_vertex_out& d) {
+        scrpos += d.scrpos;
+        worldpos += d.worldpos;
+        normal += d.normal;
+        uvs += d.uvs;
+        return *this;
+    }
+
+    // scrpos[3] holds the interpolated 1 / w
+    void correct_perspective() {
+        scale_attributes(std::fabs(1 / scrpos[3]));
+    }
+
+    static basic_vertex_out lerp(
+            const basic_vertex_out& a,
+            const basic_vertex_out& b,
+            T t) {
+        basic_vertex_out o;
+
+        o.scrpos = a.scrpos + (b.scrpos - a.scrpos) * t;
+        o.worldpos = a.worldpos + (b.worldpos - a.worldpos) * t;
+        o.normal = a.normal + (b.normal - a.normal) * t;
+        o.uvs = a.uvs + (b.uvs - a.uvs) * t;
+
+        return o;
+    }
+
+    void scale_attributes(T k) {
+        worldpos *= k;
+        normal *= k;
+        uvs *= k;
+    }
+};
+
+typedef basic_vertex_out<double> vertex_out;
+typedef basic_vertex_out<float> fvertex_out;
+
+/*
+ * Filtering across mipmap levels: mip_none always samples the full image,
+ * mip_nearest the level closest to the LOD and mip_linear blends the two
+ * levels around it. All of them filter bilinearly within a level, and fall
+ * back to mip_none on images without mipmaps.
+ */
+enum mip_filter {
+    mip_none,
+    mip_nearest,
+    mip_linear,
+};
+
+template<typename T>
+fcolor sampler(const image& img, T x, T y, size_t level = 0)
+{
+    size_t w = img.level_width(level), h = img.level_height(level);
+    x *= w;
+    y *= h;
+    x = math::clamp<T>(x, 0, w - 2);
+    y = math::clamp<T>(y, 0, h - 2);
+
+    fcolor color00, color10, color01, color11;
+    img.quad(x, y, color00, color10, color01, color11, level);
+
+    float x_left = x - std::floor(x), x_right = 1 + std::floor(x) - x;
+    float y_left = y - std::floor(y), y_right = 1 + std::floor(y) - y;
+
+    fcolor color0 = color10 * x_left + color00 * x_right;
+    fcolor color1 = color11 * x_left + color01 * x_right;
+
+    return color1 * y_left + color0 * y_right;
+}
+
+/*
+ * Blends two packed colors with a weight of w / 256 on b. Channels are
+ * spread two per 32-bit word, each in 16 bits where the products fit.
+ */
+inline color lerp_rgba8(color a, color b, uint32_t w)
+{
+    uint32_t ca = a.data.rgba, cb = b.data.rgba, wa = 256 - w;
+
+    uint32_t rb = (ca & 0x00ff00ff) * wa + (cb & 0x00ff00ff) * w;
+    uint32_t ga = ((ca >> 8) & 0x00ff00ff) * wa + ((cb >> 8) & 0x00ff00ff) * w;
+
+    return color(((rb >> 8) & 0x00ff00ff) | (ga & 0xff00ff00));
+}
+
+// bilinear filtering of format_rgba8 images, with 8 bits of subtexel weight
+template<typename T>
+color packed_sampler(const image& img, T x, T y, size_t level = 0)
+{
+    size_t w = img.level_width(level), h = img.level_height(level);
+    x *= w;
+    y *= h;
+    x = math::clamp<T>(x, 0, w - 2);
+    y = math::clamp<T>(y, 0, h - 2);
+
+    color color00, color10, color01, color11;
+    img.quad(x, y, color00, color10, color01, color11, level);
+
+    uint32_t wx = (x - std::floor(x)) * 256;
+    uint32_t wy = (y - std::floor(y)) * 256;
+
+    return lerp_rgba8(
+        lerp_rgba8(color00, color10, wx),
+        lerp_rgba8(color01, color11, wx), wy);
+}
+
+/*
+ * Level of detail from the screen-space derivatives of texture coordinates,
+ * as log2 of the longest of the pixel footprint axes in texels.
+ */
+template<typename T>
+T texture_lod(const image& img, T dudx, T dvdx, T dudy, T dvdy)
+{
+    T w = img.width(), h = img.height();
+    T len_x = dudx * dudx * w * w + dvdx * dvdx * h * h;
+    T len_y = dudy * dudy * w * w + dvdy * dvdy * h * h;
+    return T(0.5) * std::log2(std::max(len_x, len_y));
+}
+
+template<typename T>
+fcolor sampler(const image& img, T x, T y, T lod, mip_filter filter)
+{
+    size_t levels = img.levels(), level = 0;
+    float t = 0; // weight of level + 1
+
+    if(filter != mip_none && levels > 1 && lod > 0) {
+        lod = std::min(lod, T(levels - 1));
+        if(filter == mip_nearest)
+            level = lod + T(0.5);
+        else {
+            level = lod;
+            t = lod - level;
+        }
+    }
+
+    if(img.cache_format() == shrtool::format_rgba8) {
+        color c = packed_sampler(img, x, y, level);
+        if(t > 0)
+            c = lerp_rgba8(c, packed_sampler(img, x, y, level + 1), t * 256);
+        return c;
+    }
+
+    fcolor c = sampler(img, x, y, level);
+    if(t > 0)
+        c = c * (1 - t) + sampler(img, x, y, level + 1) * t;
+    return c;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// shaders
+
+/*
+ * Uniforms are in the precision of the program, so that the double program
+ * transforms and shades in double all the way, and is a reference for the
+ * float one.
+ */
+template<typename T>
+struct basic_surface_uniforms {
+    math::matrix<T, 4, 4> mvp_matrix;
+    math::matrix<T, 4, 4> m_matrix;
+    math::matrix<T, 4, 4> m_matrix_inv_t;
+
+    math::col<T, 4> light_pos;
+    math::col<T, 4> camera_pos;
+
+    image* texture;
+    mip_filter filter = mip_linear;
+};
+
+typedef basic_surface_uniforms<double> surface_uniforms;
+typedef basic_surface_uniforms<float> fsurface_uniforms;
+
+/*
+ * Vertices are processed in batches of vertex_batch_size, each batch by one
+ * thread and each stage of it across SIMD lanes, through stack buffers that
+ * are then packed into vertex_out.
+ */
+const size_t vertex_batch_size = 256;
+
+template<size_t Rows, size_t Cols, typename T>
+inline void transform_batch(
+        const math::matrix<T, 4, 4>& m,
+        const float* const in[Cols],
+        T out[Rows][vertex_batch_size],
+        size_t n) {
+    for(size_t r = 0; r < Rows; r++) {
+        T* o = out[r];
+        std::fill(o, o + n, T(0));
+
+        for(size_t c = 0; c < Cols; c++) {
+            const float* i = in[c];
+            T k = m.at(r, c);
+
+            #pragma omp simd
+            for(size_t v = 0; v < n; v++)
+                o[v] += k * i[v];
+        }
+    }
+}
+
+template<typename T>
+struct surface_vertex_shader {
+    void operator()(
+            const vertex_stream& input,
+            size_t beg, size_t n,
+            const basic_surface_uniforms<T>& u,
+            basic_vertex_out<T>* output) const {
+        const float* in_position[4];
+        const float* in_normal[3];
+        for(size_t i = 0; i < 4; i++)
+            in_position[i] = input.position[i].data() + beg;
+        for(size_t i = 0; i < 3; i++)
+            in_normal[i] = input.normal[i].data() + beg;
+
+        T clippos[4][vertex_batch_size];
+        T worldpos[4][vertex_batch_size];
+        T normal[3][vertex_batch_size];
+
+        transform_batch<4, 4>(u.mvp_matrix, in_position, clippos, n);
+        transform_batch<4, 4>(u.m_matrix, in_position, worldpos, n);
+        transform_batch<3, 3>(u.m_matrix_inv_t, in_normal, normal, n);
+
+        for(size_t v = 0; v < n; v++) {
+            basic_vertex_out<T>& out = output[v];
+
+            for(size_t i = 0; i < 4; i++) {
+                out.scrpos[i] = clippos[i][v];
+                out.worldpos[i] = worldpos[i][v];
+            }
+            for(size_t i = 0; i < 3; i++) {
+                out.normal[i] = normal[i][v];
+                out.uvs[i] = input.uvs[i][beg + v];
+            }
+        }
+    }
+};
+
+template<typename T>
+struct surface_fragment_shader {
+    color operator()(
+            const basic_vertex_out<T>& vo,
+            const basic_vertex_out<T>& ddx,
+            const basic_vertex_out<T>& ddy,
+            const basic_surface_uniforms<T>& u) const {
+        typedef math::col<T, 3> vec3;
+
+        T inv_w = 1 / vo.scrpos[3];
+        vec3 duv_dx = (ddx.uvs - vo.uvs * ddx.scrpos[3]) * inv_w;
+        vec3 duv_dy = (ddy.uvs - vo.uvs * ddy.scrpos[3]) * inv_w;
+        T lod = texture_lod(*u.texture,
+                duv_dx[0], duv_dx[1], duv_dy[0], duv_dy[1]);
+
+        vec3 light = vec3(u.light_pos - vo.worldpos);
+        vec3 view = vec3(u.camera_pos - vo.worldpos);
+        light /= math::norm(light);
+        view /= math::norm(view);
+
+        vec3 refl = - light + vo.normal * math::dot(light, vo.normal) * 2;
+        T diffuse = math::dot(light, vo.normal);
+        T specular = math::dot(refl, view);
+
+        T s = diffuse * T(0.7) + specular * specular * specular * T(0.3) +
+            T(0.1);
+
+        return sampler(*u.texture, vo.uvs[0], vo.uvs[1], lod, u.filter) * s;
+    }
+};
+
+template<typename T>
+struct surface_program : program<
+        vertex_stream,
+        basic_vertex_out<T>,
+        basic_surface_uniforms<T>,
+        surface_vertex_shader<T>,
+        surface_fragment_shader<T>> { };
+
+////////////////////////////////////////////////////////////////////////////////
+// triangle setup
+
+/*
+ * Edge equations are evaluated on integers: vertices are snapped to a grid of
+ * 1/subpixel_one pixel, and E(x, y) = a * x + b * y + c is then exact, so two
+ * triangles sharing an edge always agree on which side a pixel center lies.
+ * Pixel centers that fall exactly on an edge are given to the triangle for
+ * which it is a top or left edge, by folding a bias of -1 into c of the
+ * others. 64-bit accumulators are required beyond some hundreds of pixels.
+ *
+ * Vertices further than guard_band pixels away from the origin would overflow
+ * them. Clipping keeps every vertex within it, and triangles that are still
+ * out of it are dropped.
+ */
+const int subpixel_bits = 4;
+const int64_t subpixel_one = 1 << subpixel_bits;
+const double guard_band = 1 << 20;
+
+enum cull_reason {
+    cull_none,
+    cull_backface,
+    cull_degenerate,
+    cull_offscreen,
+    cull_no_samples, // covers no pixel center
+    cull_reason_count,
+};
+
+// counts[cull_none] is the number of surviving triangles
+struct cull_stats {
+    size_t counts[cull_reason_count] = { };
+
+    cull_stats& operator+=(const cull_stats& rhs) {
+        for(int i = 0; i < cull_reason_count; i++)
+            counts[i] += rhs.counts[i];
+        return *this;
+    }
+};
+
+struct triangle_setup {
+    uint32_t triangle;
+    uint32_t index[3]; // into the transformed vertices
+
+    // bounding box of covered pixel centers, clamped to viewport
+    int min_x, min_y;
+    int max_x, max_y;
+
+    // edge i is the one opposite to vertex i
+    int64_t a[3];
+    int64_t b[3];
+    int64_t c[3];
+
+    double inv_area;
+
+    // depth is linear in screen space: z = z2 + c0 * dz[0] + c1 * dz[1]
+    double z2;
+    double dz[2];
+
+    int64_t eval(int i, int64_t x, int64_t y) const {
+        return a[i] * x + b[i] * y + c[i];
+    }
+
+    static int64_t center(int p) {
+        return int64_t(p) * subpixel_one + subpixel_one / 2;
+    }
+
+    /*
+     * E is linear, so its extremes over the pixel centers of a rectangle lie
+     * on its corners, and which corner is decided by the signs of a and b.
+     */
+    int64_t lowest(int i, int x0, int y0, int x1, int y1) const {
+        return eval(i, center(a[i] > 0 ? x0 : x1), center(b[i] > 0 ? y0 : y1));
+    }
+
+    int64_t highest(int i, int x0, int y0, int x1, int y1) const {
+        return eval(i, center(a[i] > 0 ? x1 : x0), center(b[i] > 0 ? y1 : y0));
+    }
+
+    bool misses(int x0, int y0, int x1, int y1) const {
+        return
+            highest(0, x0, y0, x1, y1) < 0 ||
+            highest(1, x0, y0, x1, y1) < 0 ||
+            highest(2, x0, y0, x1, y1) < 0;
+    }
+
+    bool covers(int x0, int y0, int x1, int y1) const {
+        return
+            lowest(0, x0, y0, x1, y1) >= 0 &&
+            lowest(1, x0, y0, x1, y1) >= 0 &&
+            lowest(2, x0, y0, x1, y1) >= 0;
+    }
+
+    // whether all edge functions can be stepped in 32-bit lanes
+    bool fits_int32(int x0, int y0, int x1, int y1) const {
+        for(int i = 0; i < 3; i++) {
+            if(lowest(i, x0, y0, x1, y1) <= INT32_MIN ||
+               highest(i, x0, y0, x1, y1) >= INT32_MAX)
+                return false;
+        }
+        return true;
+    }
+};
+
+template<typename VertexOut>
+cull_reason setup_triangle(
+        const VertexOut* const vs[3],
+        constants& cnst,
+        triangle_setup& ts) {
+    int64_t x[3], y[3];
+
+    for(int i = 0; i < 3; i++) {
+        if(std::fabs(vs[i]->scrpos[0]) > guard_band ||
+           std::fabs(vs[i]->scrpos[1]) > guard_band)
+            return cull_offscreen;
+        x[i] = llround(vs[i]->scrpos[0] * subpixel_one);
+        y[i] = llround(vs[i]->scrpos[1] * subpixel_one);
+    }
+
+    for(int i = 0; i < 3; i++) {
+        int v0 = (i + 1) % 3, v1 = (i + 2) % 3;
+
+        ts.a[i] = y[v0] - y[v1];
+        ts.b[i] = x[v1] - x[v0];
+        ts.c[i] = x[v0] * y[v1] - x[v1] * y[v0];
+    }
+
+    // before the bias of the top-left rule, which is not part of the area
+    int64_t area = ts.eval(0, x[0], y[0]);
+
+    for(int i = 0; i < 3; i++) {
+        // top-left rule, counter-clockwise with y pointing up
+        bool top_left = ts.a[i] > 0 || (ts.a[i] == 0 && ts.b[i] < 0);
+        if(!top_left) ts.c[i] -= 1;
+    }
+
+    if(area < 0)
+        return cull_backface;
+    if(area == 0)
+        return cull_degenerate;
+
+    // the center of pixel p is at p * subpixel_one + subpixel_one / 2
+    int64_t half = subpixel_one / 2;
+    int64_t min_cx = (std::min(x[0], std::min(x[1], x[2])) - half + subpixel_one - 1)
+        >> subpixel_bits;
+    int64_t min_cy = (std::min(y[0], std::min(y[1], y[2])) - half + subpixel_one - 1)
+        >> subpixel_bits;
+    int64_t max_cx = (std::max(x[0], std::max(x[1], x[2])) - half) >> subpixel_bits;
+    int64_t max_cy = (std::max(y[0], std::max(y[1], y[2])) - half) >> subpixel_bits;
+
+    if(max_cx < 0 || max_cy < 0 ||
+       min_cx >= cnst.viewport_w || min_cy >= cnst.viewport_h)
+        return cull_offscreen;
+    if(min_cx > max_cx || min_cy > max_cy)
+        return cull_no_samples;
+
+    ts.min_x = std::max<int64_t>(min_cx, 0);
+    ts.min_y = std::max<int64_t>(min_cy, 0);
+    ts.max_x = std::min<int64_t>(max_cx, cnst.viewport_w - 1);
+    ts.max_y = std::min<int64_t>(max_cy, cnst.viewport_h - 1);
+
+    if(ts.misses(ts.min_x, ts.min_y, ts.max_x, ts.max_y))
+        return cull_no_samples;
+
+    // slivers with only a few candidate pixels are tested exhaustively
+    if((ts.max_x - ts.min_x + 1) * (ts.max_y - ts.min_y + 1) <= 4) {
+        bool any = false;
+        for(int py = ts.min_y; py <= ts.max_y && !any; py++)
+        for(int px = ts.min_x; px <= ts.max_x && !any; px++) {
+            int64_t cx = triangle_setup::center(px);
+            int64_t cy = triangle_setup::center(py);
+            any = (ts.eval(0, cx, cy) | ts.eval(1, cx, cy) |
+                    ts.eval(2, cx, cy)) >= 0;
+        }
+        if(!any)
+            return cull_no_samples;
+    }
+
+    ts.inv_area = 1.0 / area;
+
+    ts.z2 = vs[2]->scrpos[2];
+    ts.dz[0] = vs[0]->scrpos[2] - ts.z2;
+    ts.dz[1] = vs[1]->scrpos[2] - ts.z2;
+
+    return cull_none;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// tiles
+
+/*
+ * The screen is divided into tile_size x tile_size tiles. A tile is the unit
+ * of work of the rasterizer: one thread owns it from the first triangle to
+ * the last, so no two threads ever write to the same pixel (or to the same
+ * cache line, since 64 pixels of color is a whole number of lines).
+ */
+const int tile_size = 64;
+
+struct tile {
+    int min_x, min_y;
+    int max_x, max_y;
+    std::vector<size_t> primitives; // indices into tile_bins::setups
+};
+
+struct tile_bins {
+    int tiles_x = 0;
+    int tiles_y = 0;
+    std::vector<tile> tiles;
+    std::vector<triangle_setup> setups;
+    std::vector<triangle_setup> candidates; // scratch of assemble_primitives()
+    cull_stats stats;
+
+    // lists are cleared but keep their capacity across frames
+    void reset(int w, int h) {
+        tiles_x = (w + tile_size - 1) / tile_size;
+        tiles_y = (h + tile_size - 1) / tile_size;
+        tiles.resize(tiles_x * tiles_y);
+        setups.clear();
+        stats = cull_stats();
+
+        for(int ty = 0; ty < tiles_y; ty++)
+        for(int tx = 0; tx < tiles_x; tx++) {
+            tile& t = at(tx, ty);
+            t.min_x = tx * tile_size;
+            t.min_y = ty * tile_size;
+            t.max_x = std::min(t.min_x + tile_size, w) - 1;
+            t.max_y = std::min(t.min_y + tile_size, h) - 1;
+            t.primitives.clear();
+        }
+    }
+
+    tile& at(int tx, int ty) { return tiles[ty * tiles_x + tx]; }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// framebuffer
+
+/*
+ * Attachments are stored upwards from the bottom scanline, pitch() pixels
+ * apart. The pitch is padded to framebuffer_pitch_align pixels, so that every
+ * scanline starts on framebuffer_alignment, and tiles never share cache lines
+ * whatever the width.
+ *
+ * defer_clear() only marks all tiles as pending: a pending tile is cleared by
+ * the thread that first draws into it, while its lines are about to be used
+ * anyway, and a tile that is never drawn into is filled with the clear color
+ * straight into the destination of present(). Nothing else may be read from
+ * a pending tile.
+ */
+const size_t framebuffer_alignment = 64;
+const int framebuffer_pitch_align = 16;
+
+template<typename T>
+class aligned_buffer {
+    std::unique_ptr<char[]> storage_;
+    T* data_ = nullptr;
+
+public:
+    void resize(size_t n) {
+        storage_.reset(new char[n * sizeof(T) + framebuffer_alignment]);
+        uintptr_t p = reinterpret_cast<uintptr_t>(storage_.get());
+        p = (p + framebuffer_alignment - 1) & ~(framebuffer_alignment - 1);
+        data_ = reinterpret_cast<T*>(p);
+    }
+
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+};
+
+class framebuffer {
+    int width_;
+    int height_;
+    int pitch_;
+    int tiles_x_;
+    int tiles_y_;
+
+    aligned_buffer<color> color_;
+    aligned_buffer<float> depth_;
+    aligned_buffer<visibility> visibility_;
+
+    color clear_color_;
+    float clear_depth_;
+    bool clear_visibility_;
+    std::vector<uint8_t> pending_;
+
+    static uint32_t bits_of(float f) {
+        uint32_t u;
+        std::memcpy(&u, &f, sizeof(u));
+        return u;
+    }
+
+public:
+    framebuffer(int w, int h) :
+            width_(w), height_(h),
+            pitch_((w + framebuffer_pitch_align - 1) &
+                ~(framebuffer_pitch_align - 1)),
+            tiles_x_((w + tile_size - 1) / tile_size),
+            tiles_y_((h + tile_size - 1) / tile_size),
+            clear_depth_(1), clear_visibility_(false),
+            pending_(tiles_x_ * tiles_y_, 0) {
+        color_.resize(size_t(pitch_) * h);
+        depth_.resize(size_t(pitch_) * h);
+        visibility_.resize(size_t(pitch_) * h);
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    // pixels from a scanline to the next, in every attachment
+    int pitch() const { return pitch_; }
+
+    color* color_buffer() { return color_.data(); }
+    float* depth_buffer() { return depth_.data(); }
+    visibility* visibility_buffer() { return visibility_.data(); }
+
+    bool pending(int tx, int ty) const {
+        return pending_[ty * tiles_x_ + tx];
+    }
+
+    void defer_clear(color c, float depth, bool clear_visibility) {
+        PROFILE_ZONE("clear");
+        clear_color_ = c;
+        clear_depth_ = depth;
+        clear_visibility_ = clear_visibility;
+        std::fill(pending_.begin(), pending_.end(), 1);
+    }
+
+    // to be called by the owner of the tile before it draws
+    void resolve_tile(int tx, int ty) {
+        uint8_t& p = pending_[ty * tiles_x_ + tx];
+        if(!p) return;
+
+        int x0 = tx * tile_size, x1 = std::min(x0 + tile_size, width_);
+        int y0 = ty * tile_size, y1 = std::min(y0 + tile_size, height_);
+
+        for(int y = y0; y < y1; y++) {
+            size_t offset = size_t(y) * pitch_;
+            std::fill(color_.data() + offset + x0,
+                    color_.data() + offset + x1, clear_color_);
+            std::fill(depth_.data() + offset + x0,
+                    depth_.data() + offset + x1, clear_depth_);
+
+            if(clear_visibility_) {
+                visibility* vis = visibility_.data() + offset;
+                for(int x = x0; x < x1; x++)
+                    vis[x].triangle = visibility::none;
+            }
+        }
+
+        p = 0;
+    }
+
+    void resolve() {
+        #pragma omp parallel for schedule(dynamic)
+        for(int i = 0; i < tiles_x_ * tiles_y_; i++)
+            resolve_tile(i % tiles_x_, i / tiles_x_);
+    }
+
+    // copy colors top-down into dest, whose scanlines are pitch pixels apart
+    void present(uint32_t* dest, size_t pitch) const {
+        PROFILE_ZONE("present");
+        #pragma omp parallel for schedule(static)
+        for(int y = 0; y < height_; y++) {
+            const color* src = color_.data() + size_t(y) * pitch_;
+            uint32_t* dst = dest + (height_ - y - 1) * pitch;
+            int ty = y / tile_size;
+
+            for(int tx = 0; tx < tiles_x_; tx++) {
+                int x0 = tx * tile_size, x1 = std::min(x0 + tile_size, width_);
+
+                if(pending(tx, ty))
+                    std::fill(dst + x0, dst + x1, clear_color_.data.rgba);
+                else
+                    std::memcpy(dst + x0, src + x0, (x1 - x0) * sizeof(color));
+            }
+        }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// pipeline
+
+/*
+ * Runs the vertex shader of prog over the input in parallel, one batch of
+ * vertex_batch_size per call. Output is in clip space.
+ */
+template<typename Program>
+void vertex_transformation(
+        const Program& prog,
+        const typename Program::vertex_in_type& input,
+        std::vector<typename Program::vertex_out_type>& output) {
+    PROFILE_ZONE("vertex");
+    size_t count = input.size();
+    output.resize(count);
+
+    int batches = (count + vertex_batch_size - 1) / vertex_batch_size;
+
+    #pragma omp parallel for schedule(static)
+    for(int b = 0; b < batches; b++) {
+        size_t beg = b * vertex_batch_size;
+        size_t n = std::min(vertex_batch_size, count - beg);
+
+        prog.vertex_shader(input, beg, n, prog.uniforms, &output[beg]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// clipping
+
+/*
+ * Triangles are clipped in homogeneous space, before the perspective divide.
+ * Near and far planes are exact. Side planes are pushed out to a guard band,
+ * so that only triangles that would overflow the fixed-point rasterizer are
+ * cut on them, and the rest of what is off-screen is left to bounding boxes.
+ * Clipped polygons get new vertices appended and are fanned into triangles.
+ */
+const int clip_plane_count = 6;
+const int clip_max_vertices = 3 + clip_plane_count;
+
+template<typename T>
+inline T clip_distance(const math::col<T, 4>& p, int plane, T gx, T gy) {
+    switch(plane) {
+    case 0: return p[3] + p[2]; // near
+    case 1: return p[3] - p[2]; // far
+    case 2: return gx * p[3] + p[0];
+    case 3: return gx * p[3] - p[0];
+    case 4: return gy * p[3] + p[1];
+    case 5: return gy * p[3] - p[1];
+    }
+    return 0;
+}
+
+template<typename T>
+inline uint8_t clip_outcode(const math::col<T, 4>& p, T gx, T gy) {
+    uint8_t code = 0;
+    for(int i = 0; i < clip_plane_count; i++)
+        if(clip_distance(p, i, gx, gy) < 0)
+            code |= 1 << i;
+    return code;
+}
+
+// Sutherland-Hodgman against every plane set in mask, returns the vertex count
+template<typename VertexOut, typename T>
+int clip_polygon(VertexOut poly[clip_max_vertices], uint8_t mask,
+        T gx, T gy) {
+    VertexOut temp[clip_max_vertices];
+    int count = 3;
+
+    for(int plane = 0; plane < clip_plane_count && count; plane++) {
+        if(!(mask & (1 << plane)))
+            continue;
+
+        int temp_count = 0;
+        for(int i = 0; i < count; i++) {
+            const VertexOut& a = poly[i];
+            const VertexOut& b = poly[(i + 1) % count];
+            T da = clip_distance(a.scrpos, plane, gx, gy);
+            T db = clip_distance(b.scrpos, plane, gx, gy);
+
+            if(da >= 0)
+                temp[temp_count++] = a;
+            if((da >= 0) != (db >= 0))
+                temp[temp_count++] = VertexOut::lerp(a, b, da / (da - db));
+        }
+
+        std::copy(temp, temp + temp_count, poly);
+        count = temp_count;
+    }
+
+    return count;
+}
+
+/*
+ * Perspective divide and viewport transformation. Attributes are divided by
+ * w as well, so that they can be interpolated linearly in screen space and
+ * corrected by scrpos[3] = 1 / w in correct_perspective().
+ */
+template<typename VertexOut>
+inline void project_vertex(VertexOut& v, const constants& cnst) {
+    typedef typename VertexOut::value_type T;
+    T inv_w = 1 / v.scrpos[3];
+
+    v.scrpos[0] = (v.scrpos[0] * inv_w * T(0.5) + T(0.5)) * cnst.viewport_w;
+    v.scrpos[1] = (v.scrpos[1] * inv_w * T(0.5) + T(0.5)) * cnst.viewport_h;
+    v.scrpos[2] = (v.scrpos[2] * inv_w * T(0.5) + T(0.5));
+    v.scrpos[3] = inv_w;
+
+    v.scale_attributes(inv_w);
+}
+
+/*
+ * Takes vertices in clip space and leaves them in screen space, with the
+ * vertices made by clipping appended. Triangles that survive are written to
+ * output in their original order.
+ */
+template<typename VertexOut>
+void clip_primitives(
+        std::vector<VertexOut>& vertices,
+        const std::vector<uint32_t>& indices,
+        constants& cnst,
+        std::vector<uint32_t>& output) {
+    PROFILE_ZONE("clip");
+    typedef typename VertexOut::value_type T;
+    GUARD_(indices.size() % 3 == 0);
+
+    // guard band in NDC: screen coordinates stay within guard_band pixels
+    T gx = guard_band / cnst.viewport_w;
+    T gy = guard_band / cnst.viewport_h;
+
+    int count = vertices.size();
+    std::vector<uint8_t> outcodes(count);
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < count; i++)
+        outcodes[i] = clip_outcode(vertices[i].scrpos, gx, gy);
+
+    output.clear();
+
+    for(size_t i = 0; i < indices.size(); i += 3) {
+        const uint32_t* idx = &indices[i];
+        uint8_t c0 = outcodes[idx[0]], c1 = outcodes[idx[1]],
+                c2 = outcodes[idx[2]];
+
+        if(c0 & c1 & c2)
+            continue;
+
+        if(!(c0 | c1 | c2)) {
+            output.insert(output.end(), idx, idx + 3);
+            continue;
+        }
+
+        VertexOut poly[clip_max_vertices] = {
+            vertices[idx[0]], vertices[idx[1]], vertices[idx[2]] };
+        int poly_count = clip_polygon(poly, c0 | c1 | c2, gx, gy);
+        if(poly_count < 3)
+            continue;
+
+        uint32_t first = vertices.size();
+        vertices.insert(vertices.end(), poly, poly + poly_count);
+        for(int v = 1; v + 1 < poly_count; v++) {
+            output.push_back(first);
+            output.push_back(first + v);
+            output.push_back(first + v + 1);
+        }
+    }
+
+    count = vertices.size();
+
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < count; i++) {
+        // vertices behind the camera are only referred to by culled triangles
+        if(vertices[i].scrpos[3] > 0)
+            project_vertex(vertices[i], cnst);
+    }
+}
+
+inline bool depth_passes(depth_func func, float z, float ref) {
+    switch(func) {
+    case depth_never:       return false;
+    case depth_less:        return z < ref;
+    case depth_lequal:      return z <= ref;
+    case depth_equal:       return z == ref;
+    case depth_greater:     return z > ref;
+    case depth_gequal:      return z >= ref;
+    case depth_notequal:    return z != ref;
+    case depth_always:      return true;
+    }
+    return false;
+}
+
+/*
+ * Screen-space gradients of the interpolants of a triangle in screen space,
+ * from the derivatives of its barycentrics. rasterize() gets the same from
+ * its fixed-point edge functions.
+ */
+template<typename VertexOut>
+inline void interpolant_gradients(
+        const VertexOut* const vs[3],
+        VertexOut& ddx, VertexOut& ddy) {
+    typedef typename VertexOut::value_type T;
+
+    T x0 = vs[0]->scrpos[0], y0 = vs[0]->scrpos[1];
+    T x1 = vs[1]->scrpos[0], y1 = vs[1]->scrpos[1];
+    T x2 = vs[2]->scrpos[0], y2 = vs[2]->scrpos[1];
+    T inv_det = 1 / ((y1 - y2) * (x0 - x2) + (x2 - x1) * (y0 - y2));
+
+    T dx[2] = { (y1 - y2) * inv_det, (y2 - y0) * inv_det };
+    T dy[2] = { (x2 - x1) * inv_det, (x0 - x2) * inv_det };
+    ddx = VertexOut::combine(
+            *vs[0], dx[0], *vs[1], dx[1], *vs[2], -dx[0] - dx[1]);
+    ddy = VertexOut::combine(
+            *vs[0], dy[0], *vs[1], dy[1], *vs[2], -dy[0] - dy[1]);
+}
+
+/*
+ * Depth is tested before attributes are corrected, so that fragments that
+ * are hidden never pay for the division and the fragment shader. interp is
+ * the interpolant at the pixel, as stepped by rasterize() along ddx and ddy.
+ */
+template<typename Program>
+inline void shade_fragment(
+        const Program& prog,
+        const typename Program::vertex_out_type& interp,
+        const typename Program::vertex_out_type& ddx,
+        const typename Program::vertex_out_type& ddy,
+        const triangle_setup& ts,
+        constants& cnst,
+        int x, int y,
+        float coef_0, float coef_1, float z) {
+    typedef typename Program::vertex_out_type vertex_type;
+
+    if(z > 1 || z < 0)
+        return;
+
+    framebuffer& fb = *cnst.target;
+    size_t offset = size_t(y) * fb.pitch() + x;
+    float& depth = fb.depth_buffer()[offset];
+    if(!depth_passes(cnst.depth_test, z, depth))
+        return;
+    if(cnst.depth_write)
+        depth = z;
+
+    if(cnst.shading == shading_deferred) {
+        visibility& vis = fb.visibility_buffer()[offset];
+        vis.triangle = ts.triangle;
+        vis.coef[0] = coef_0;
+        vis.coef[1] = coef_1;
+        return;
+    }
+
+    vertex_type vo = interp;
+    vo.correct_perspective();
+
+    color c = prog.fragment_shader(vo, ddx, ddy, prog.uniforms);
+    std::swap(c.data.channels.r, c.data.channels.b);
+
+    fb.color_buffer()[offset] = c;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// pixel packets
+
+/*
+ * A packet is lane_count horizontally adjacent pixels whose coverage,
+ * barycentrics and depth are evaluated at once. Edge functions are held in
+ * 32-bit lanes, which is only exact where triangle_setup::fits_int32() says
+ * so. Bit l of mask is set if pixel l is covered.
+ */
+#if defined(__AVX2__)
+const int lane_count = 8;
+#elif defined(__SSE2__) || defined(_M_X64)
+const int lane_count = 4;
+#else
+const int lane_count = 4;
+#endif
+
+struct pixel_packet {
+    unsigned mask;
+    float coef[2][lane_count];
+    float z[lane_count];
+};
+
+/*
+ * Edge function l pixels to the right. Lanes past the last pixel of a row may
+ * leave the range checked by fits_int32(), so they wrap around in unsigned
+ * arithmetic instead of overflowing; they are masked out anyway.
+ */
+inline int32_t step_lane(int32_t e, int32_t step, int l) {
+    return int32_t(uint32_t(e) + uint32_t(step) * uint32_t(l));
+}
+
+#if defined(__AVX2__)
+
+inline void evaluate_packet(
+        const triangle_setup& ts,
+        const int32_t e[3],
+        const int32_t step[3],
+        int count,
+        pixel_packet& p) {
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(e[0]),
+            _mm256_mullo_epi32(lane, _mm256_set1_epi32(step[0])));
+    __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(e[1]),
+            _mm256_mullo_epi32(lane, _mm256_set1_epi32(step[1])));
+    __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(e[2]),
+            _mm256_mullo_epi32(lane, _mm256_set1_epi32(step[2])));
+
+    __m256i sign = _mm256_or_si256(e0, _mm256_or_si256(e1, e2));
+    p.mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(sign)) &
+        ((1u << count) - 1);
+
+    __m256 inv_area = _mm256_set1_ps(ts.inv_area);
+    __m256 c0 = _mm256_mul_ps(_mm256_cvtepi32_ps(e0), inv_area);
+    __m256 c1 = _mm256_mul_ps(_mm256_cvtepi32_ps(e1), inv_area);
+    __m256 z = _mm256_add_ps(_mm256_set1_ps(ts.z2), _mm256_add_ps(
+            _mm256_mul_ps(c0, _mm256_set1_ps(ts.dz[0])),
+            _mm256_mul_ps(c1, _mm256_set1_ps(ts.dz[1]))));
+
+    _mm256_storeu_ps(p.coef[0], c0);
+    _mm256_storeu_ps(p.coef[1], c1);
+    _mm256_storeu_ps(p.z, z);
+}
+
+#elif defined(__SSE2__) || defined(_M_X64)
+
+inline void evaluate_packet(
+        const triangle_setup& ts,
+        const int32_t e[3],
+        const int32_t step[3],
+        int count,
+        pixel_packet& p) {
+    // SSE2 has no 32-bit multiplication: lane offsets are built by hand
+    __m128i e0 = _mm_setr_epi32(e[0], step_lane(e[0], step[0], 1),
+            step_lane(e[0], step[0], 2), step_lane(e[0], step[0], 3));
+    __m128i e1 = _mm_setr_epi32(e[1], step_lane(e[1], step[1], 1),
+            step_lane(e[1], step[1], 2), step_lane(e[1], step[1], 3));
+    __m128i e2 = _mm_setr_epi32(e[2], step_lane(e[2], step[2], 1),
+            step_lane(e[2], step[2], 2), step_lane(e[2], step[2], 3));
+
+    __m128i sign = _mm_or_si128(e0, _mm_or_si128(e1, e2));
+    p.mask = ~_mm_movemask_ps(_mm_castsi128_ps(sign)) &
+        ((1u << count) - 1);
+
+    __m128 inv_area = _mm_set1_ps(ts.inv_area);
+    __m128 c0 = _mm_mul_ps(_mm_cvtepi32_ps(e0), inv_area);
+    __m128 c1 = _mm_mul_ps(_mm_cvtepi32_ps(e1), inv_area);
+    __m128 z = _mm_add_ps(_mm_set1_ps(ts.z2), _mm_add_ps(
+            _mm_mul_ps(c0, _mm_set1_ps(ts.dz[0])),
+            _mm_mul_ps(c1, _mm_set1_ps(ts.dz[1]))));
+
+    _mm_storeu_ps(p.coef[0], c0);
+    _mm_storeu_ps(p.coef[1], c1);
+    _mm_storeu_ps(p.z, z);
+}
+
+#else
+
+inline void evaluate_packet(
+        const triangle_setup& ts,
+        const int32_t e[3],
+        const int32_t step[3],
+        int count,
+        pixel_packet& p) {
+    p.mask = 0;
+
+    for(int l = 0; l < count; l++) {
+        int32_t e0 = step_lane(e[0], step[0], l);
+        int32_t e1 = step_lane(e[1], step[1], l);
+        int32_t e2 = step_lane(e[2], step[2], l);
+
+        if((e0 | e1 | e2) >= 0)
+            p.mask |= 1u << l;
+
+        p.coef[0][l] = e0 * ts.inv_area;
+        p.coef[1][l] = e1 * ts.inv_area;
+        p.z[l] = ts.z2 + p.coef[0][l] * ts.dz[0] + p.coef[1][l] * ts.dz[1];
+    }
+}
+
+#endif
+
+/*
+ * The covered rectangle is walked in blocks of block_size x block_size
+ * pixels. Edge functions are first evaluated on the corners of each block:
+ * blocks outside of any edge are skipped, blocks inside all edges are filled
+ * without testing, and only the rest are tested pixel by pixel. Within a
+ * block edge functions are stepped by a constant per pixel and per scanline,
+ * one packet at a time where they fit in 32 bits, and one pixel at a time
+ * in 64 bits otherwise.
+ *
+ * Attributes divided by w are linear in screen space, and so are their
+ * interpolants. Their gradients ddx and ddy are set up once per triangle,
+ * the interpolant is evaluated exactly on the first pixel of each block, and
+ * then stepped by a few adds per pixel and per scanline, which keeps the
+ * accumulated error within block_size steps. Only correct_perspective() is
+ * left to do per fragment, with a single reciprocal.
+ */
+const int block_size = 8;
+
+template<typename Program>
+void rasterize(
+        const Program& prog,
+        const typename Program::vertex_out_type* const vs[3],
+        const triangle_setup& ts,
+        constants& cnst,
+        const tile& t) {
+    typedef typename Program::vertex_out_type vertex_type;
+    typedef typename Program::value_type T;
+
+    int min_x = std::max(ts.min_x, t.min_x);
+    int max_x = std::min(ts.max_x, t.max_x);
+    int min_y = std::max(ts.min_y, t.min_y);
+    int max_y = std::min(ts.max_y, t.max_y);
+
+    int64_t step_x[3], step_y[3];
+    for(int i = 0; i < 3; i++) {
+        step_x[i] = ts.a[i] * subpixel_one;
+        step_y[i] = ts.b[i] * subpixel_one;
+    }
+
+    // deferred shading only records barycentrics, which need no stepping
+    bool interpolate = cnst.shading != shading_deferred;
+
+    vertex_type ddx, ddy;
+    if(interpolate) {
+        T dx[2] = { T(step_x[0] * ts.inv_area), T(step_x[1] * ts.inv_area) };
+        T dy[2] = { T(step_y[0] * ts.inv_area), T(step_y[1] * ts.inv_area) };
+        ddx = vertex_type::combine(
+                *vs[0], dx[0], *vs[1], dx[1], *vs[2], -dx[0] - dx[1]);
+        ddy = vertex_type::combine(
+                *vs[0], dy[0], *vs[1], dy[1], *vs[2], -dy[0] - dy[1]);
+    }
+
+    for(int by = min_y & ~(block_size - 1); by <= max_y; by += block_size)
+    for(int bx = min_x & ~(block_size - 1); bx <= max_x; bx += block_size) {
+        int x0 = std::max(bx, min_x), x1 = std::min(bx + block_size - 1, max_x);
+        int y0 = std::max(by, min_y), y1 = std::min(by + block_size - 1, max_y);
+
+        if(ts.misses(x0, y0, x1, y1))
+            continue;
+
+        bool covered = ts.covers(x0, y0, x1, y1);
+
+        int64_t row[3];
+        for(int i = 0; i < 3; i++)
+            row[i] = ts.eval(i,
+                    triangle_setup::center(x0),
+                    triangle_setup::center(y0));
+
+        vertex_type row_interp;
+        if(interpolate) {
+            T c0 = row[0] * ts.inv_area, c1 = row[1] * ts.inv_area;
+            row_interp = vertex_type::combine(
+                    *vs[0], c0, *vs[1], c1, *vs[2], 1 - c0 - c1);
+        }
+
+        if(ts.fits_int32(x0, y0, x1, y1)) {
+            int32_t step[3] = {
+                int32_t(step_x[0]), int32_t(step_x[1]), int32_t(step_x[2]) };
+
+            for(int y = y0; y <= y1; y++) {
+                int32_t e[3] = {
+                    int32_t(row[0]), int32_t(row[1]), int32_t(row[2]) };
+                vertex_type interp = row_interp;
+
+                for(int x = x0; x <= x1; x += lane_count) {
+                    int count = std::min(lane_count, x1 - x + 1);
+
+                    pixel_packet p;
+                    evaluate_packet(ts, e, step, count, p);
+                    if(covered)
+                        p.mask = (1u << count) - 1;
+
+                    for(int l = 0; l < count; l++) {
+                        if(p.mask & (1u << l))
+                            shade_fragment(prog, interp, ddx, ddy, ts, cnst, x + l, y,
+                                p.coef[0][l], p.coef[1][l], p.z[l]);
+                        if(interpolate)
+                            interp += ddx;
+                    }
+
+                    for(int i = 0; i < 3; i++)
+                        e[i] = step_lane(e[i], step[i], lane_count);
+                }
+
+                for(int i = 0; i < 3; i++)
+                    row[i] += step_y[i];
+                if(interpolate)
+                    row_interp += ddy;
+            }
+
+            continue;
+        }
+
+        for(int y = y0; y <= y1; y++) {
+            int64_t e0 = row[0], e1 = row[1], e2 = row[2];
+            vertex_type interp = row_interp;
+
+            for(int x = x0; x <= x1; x++,
+                    e0 += step_x[0], e1 += step_x[1], e2 += step_x[2]) {
+                if(covered || (e0 | e1 | e2) >= 0) {
+                    float coef_0 = e0 * ts.inv_area;
+                    float coef_1 = e1 * ts.inv_area;
+                    float z = ts.z2 + coef_0 * ts.dz[0] + coef_1 * ts.dz[1];
+
+                    shade_fragment(prog, interp, ddx, ddy, ts, cnst, x, y,
+                            coef_0, coef_1, z);
+                }
+                if(interpolate)
+                    interp += ddx;
+            }
+
+            for(int i = 0; i < 3; i++)
+                row[i] += step_y[i];
+            if(interpolate)
+                row_interp += ddy;
+        }
+    }
+}
+
+/*
+ * Primitive assembly runs in three parallel passes. Triangles are first set
+ * up and culled in chunks of cull_chunk_size, and each chunk compacts its
+ * survivors at its own start in bins.candidates. The survivors are then
+ * gathered into bins.setups at offsets given by a scan of the chunk counts,
+ * which keeps submission order. At last each row of tiles bins them into
+ * every tile they touch, so that each tile can later be drawn by a single
+ * thread from the first primitive to the last without any synchronization.
+ */
+const int cull_chunk_size = 1024;
+
+template<typename VertexOut>
+void assemble_primitives(
+        const std::vector<VertexOut>& vertices,
+        const std::vector<uint32_t>& indices,
+        constants& cnst,
+        tile_bins& bins) {
+    PROFILE_ZONE("assemble");
+    GUARD_(indices.size() % 3 == 0);
+
+    bins.reset(cnst.viewport_w, cnst.viewport_h);
+
+    int count = indices.size() / 3;
+    int chunks = (count + cull_chunk_size - 1) / cull_chunk_size;
+
+    bins.candidates.resize(count);
+    std::vector<size_t> offsets(chunks + 1, 0);
+    std::vector<cull_stats> stats(chunks);
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int c = 0; c < chunks; c++) {
+        int beg = c * cull_chunk_size;
+        int end = std::min(beg + cull_chunk_size, count);
+        int survivors = beg;
+
+        for(int t = beg; t < end; t++) {
+            const uint32_t* idx = &indices[t * 3];
+            const VertexOut* vs[3] = {
+                &vertices[idx[0]],
+                &vertices[idx[1]],
+                &vertices[idx[2]],
+            };
+
+            triangle_setup& ts = bins.candidates[survivors];
+            cull_reason r = setup_triangle(vs, cnst, ts);
+            stats[c].counts[r] += 1;
+            if(r != cull_none)
+                continue;
+
+            ts.triangle = t;
+            std::copy(idx, idx + 3, ts.index);
+            survivors += 1;
+        }
+
+        offsets[c + 1] = survivors - beg;
+    }
+
+    for(int c = 0; c < chunks; c++) {
+        offsets[c + 1] += offsets[c];
+        bins.stats += stats[c];
+    }
+
+    bins.setups.resize(offsets[chunks]);
+
+    #pragma omp parallel for schedule(static)
+    for(int c = 0; c < chunks; c++) {
+        auto src = bins.candidates.begin() + c * cull_chunk_size;
+        std::copy(src, src + (offsets[c + 1] - offsets[c]),
+                bins.setups.begin() + offsets[c]);
+    }
+
+    int setup_count = bins.setups.size();
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int ty = 0; ty < bins.tiles_y; ty++)
+    for(int p = 0; p < setup_count; p++) {
+        const triangle_setup& ts = bins.setups[p];
+        if(ts.min_y / tile_size > ty || ts.max_y / tile_size < ty)
+            continue;
+
+        for(int tx = ts.min_x / tile_size; tx <= ts.max_x / tile_size; tx++) {
+            tile& t = bins.at(tx, ty);
+            if(ts.misses(t.min_x, t.min_y, t.max_x, t.max_y))
+                continue;
+            t.primitives.push_back(p);
+        }
+    }
+}
+
+template<typename Program>
+void rasterize_tiles(
+        const Program& prog,
+        const std::vector<typename Program::vertex_out_type>& vertices,
+        constants& cnst,
+        tile_bins& bins) {
+    PROFILE_ZONE("raster");
+    int tile_count = bins.tiles.size();
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int i = 0; i < tile_count; i++) {
+        const tile& t = bins.tiles[i];
+        if(t.primitives.empty())
+            continue;
+
+        cnst.target->resolve_tile(i % bins.tiles_x, i / bins.tiles_x);
+
+        for(size_t prim : t.primitives) {
+            const triangle_setup& ts = bins.setups[prim];
+            const typename Program::vertex_out_type* vs[3] = {
+                &vertices[ts.index[0]],
+                &vertices[ts.index[1]],
+                &vertices[ts.index[2]],
+            };
+            rasterize(prog, vs, ts, cnst, t);
+        }
+    }
+}
+
+template<typename Program>
+void shade_visibility(
+        const Program& prog,
+        const std::vector<typename Program::vertex_out_type>& vertices,
+        const std::vector<uint32_t>& indices,
+        constants& cnst,
+        tile_bins& bins) {
+    PROFILE_ZONE("shade");
+    typedef typename Program::vertex_out_type vertex_type;
+    typedef typename Program::value_type T;
+
+    framebuffer& fb = *cnst.target;
+    int tile_count = bins.tiles.size();
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int i = 0; i < tile_count; i++) {
+        const tile& t = bins.tiles[i];
+        if(fb.pending(i % bins.tiles_x, i / bins.tiles_x))
+            continue;
+
+        // neighbouring pixels mostly share a triangle and its gradients
+        uint32_t last = visibility::none;
+        vertex_type ddx, ddy;
+
+        for(int y = t.min_y; y <= t.max_y; y++)
+        for(int x = t.min_x; x <= t.max_x; x++) {
+            size_t offset = size_t(y) * fb.pitch() + x;
+            const visibility& vis = fb.visibility_buffer()[offset];
+            if(vis.triangle == visibility::none)
+                continue;
+
+            const uint32_t* idx = &indices[vis.triangle * 3];
+            const vertex_type* vs[3] = {
+                &vertices[idx[0]],
+                &vertices[idx[1]],
+                &vertices[idx[2]],
+            };
+
+            if(vis.triangle != last) {
+                interpolant_gradients(vs, ddx, ddy);
+                last = vis.triangle;
+            }
+
+            vertex_type vo = vertex_type::from_coef(
+                *vs[0], T(vis.coef[0]),
+                *vs[1], T(vis.coef[1]),
+                *vs[2], T(1 - vis.coef[0] - vis.coef[1]));
+
+            color c = prog.fragment_shader(vo, ddx, ddy, prog.uniforms);
+            std::swap(c.data.channels.r, c.data.channels.b);
+
+            fb.color_buffer()[offset] = c;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// frames
+
+/*
+ * A frame goes through two stages: geometry (vertex transformation, clipping
+ * and primitive assembly) and raster (rasterization, deferred shading and
+ * presentation). Within one frame they depend on each other, but with a
+ * latency of 2 the geometry of a frame runs on a worker thread while the
+ * frame submitted before it is rasterized, so that neither leaves the cores
+ * idle while the other one is running its serial parts. Everything a stage
+ * writes per frame, the program with its uniforms, the transformed vertices
+ * and the bins, is double-buffered. Only the raster stage touches the
+ * framebuffer, so one is enough. With a latency of 1 the stages of each
+ * frame run one after the other, as they did before pipelining.
+ *
+ * Each stage has its own OpenMP team. The geometry team is kept smaller,
+ * as there is far less work in it: half of omp_get_max_threads() unless
+ * geometry_threads says otherwise.
+ *
+ * Vertices are any Program::vertex_in_type, with indices of triangles into
+ * them, and an indexed_stream can stand for both when that type is
+ * vertex_stream. Both are read, not copied, every frame.
+ */
+template<typename Program>
+class frame_pipeline {
+public:
+    typedef typename Program::vertex_out_type vertex_type;
+
+    color background = color(0xff333333u);
+
+    frame_pipeline(
+            const typename Program::vertex_in_type& vertices,
+            const std::vector<uint32_t>& indices,
+            constants& cnst,
+            int latency = 2,
+            int geometry_threads = 0) :
+            vertices_(vertices), indices_(indices), cnst_(cnst),
+            latency_(latency), geometry_threads_(geometry_threads),
+            next_(0), job_(nullptr), quit_(false) {
+        GUARD_(latency_ == 1 || latency_ == 2);
+        GUARD_(geometry_threads_ >= 0);
+        if(latency_ == 2)
+            worker_ = std::thread(&frame_pipeline::work, this);
+    }
+
+    frame_pipeline(const indexed_stream& input, constants& cnst,
+            int latency = 2, int geometry_threads = 0) :
+            frame_pipeline(input.vertices, input.indices, cnst,
+                latency, geometry_threads) { }
+
+    ~frame_pipeline() {
+        if(!worker_.joinable())
+            return;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        cond_.notify_all();
+        worker_.join();
+    }
+
+    /*
+     * Submits a frame drawn with prog, and presents to dest the frame that
+     * is latency - 1 submissions old, if there is any yet.
+     */
+    void submit(const Program& prog, uint32_t* dest, size_t pitch) {
+        frame& f = frames_[next_];
+        f.prog = prog;
+
+        if(latency_ == 1) {
+            geometry(f);
+            raster(f, dest, pitch);
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            job_ = &f;
+        }
+        cond_.notify_all();
+
+        frame& last = frames_[next_ ^ 1];
+        if(last.ready)
+            raster(last, dest, pitch);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]() { return job_ == nullptr; });
+        next_ ^= 1;
+    }
+
+private:
+    struct frame {
+        Program prog;
+        std::vector<vertex_type> vertices;
+        std::vector<uint32_t> indices;
+        tile_bins bins;
+        bool ready = false;
+    };
+
+    void geometry(frame& f) {
+        vertex_transformation(f.prog, vertices_, f.vertices);
+        clip_primitives(f.vertices, indices_, cnst_, f.indices);
+        assemble_primitives(f.vertices, f.indices, cnst_, f.bins);
+        f.ready = true;
+    }
+
+    void raster(frame& f, uint32_t* dest, size_t pitch) {
+        framebuffer& fb = *cnst_.target;
+        bool deferred = cnst_.shading == shading_deferred;
+
+        fb.defer_clear(background, 1, deferred);
+        rasterize_tiles(f.prog, f.vertices, cnst_, f.bins);
+        if(deferred)
+            shade_visibility(f.prog, f.vertices, f.indices, cnst_, f.bins);
+        fb.present(dest, pitch);
+    }
+
+    void work() {
+        omp_set_num_threads(geometry_threads_ ? geometry_threads_ :
+                std::max(1, omp_get_max_threads() / 2));
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(true) {
+            cond_.wait(lock, [this]() { return job_ || quit_; });
+            if(quit_)
+                return;
+
+            lock.unlock();
+            geometry(*job_);
+            lock.lock();
+
+            job_ = nullptr;
+            cond_.notify_all();
+        }
+    }
+
+    const typename Program::vertex_in_type& vertices_;
+    const std::vector<uint32_t>& indices_;
+    constants& cnst_;
+    int latency_;
+    int geometry_threads_;
+    int next_;
+    frame frames_[2];
+
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    frame* job_;
+    bool quit_;
+};
+
+}
+
+#endif // SOFT_PIPELINE_H_INCLUDED
@@ -0,0 +1,227 @@
+/*
+ * Renders a model offscreen along a fixed camera path, without any window,
+ * and reports the frame rate and the time spent in each pipeline stage.
+ *
+ *     benchmark [model.obj] [frames] [output.ppm] [texture.ppm]
+ *
+ * Stages are timed on a sequential pass, as they overlap in the pipelined
+ * pass that follows it. The last frame can be saved for comparison. The
+ * texture defaults to textures/texture.ppm next to the directory of the model.
+ */
+
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <cstdlib>
+
+#include "common/exception.h"
+#include "common/mesh.h"
+#include "common/image.h"
+
+#include "soft_pipeline.h"
+
+using namespace std;
+using namespace gcl;
+using namespace shrtool;
+using namespace shrtool::math;
+
+typedef chrono::steady_clock clock_type;
+
+enum stage {
+    stage_transform,
+    stage_clip,
+    stage_assemble,
+    stage_raster,
+    stage_shade,
+    stage_present,
+    stage_count,
+};
+
+const char* stage_names[stage_count] = {
+    "transform", "clip", "assemble", "raster", "shade", "present",
+};
+
+// ../textures/texture.ppm relative to the directory of the model
+string default_texture(const string& model_path) {
+    size_t slash = model_path.find_last_of("/\\");
+    string dir = slash == string::npos ? "." : model_path.substr(0, slash);
+    return dir + "/../textures/texture.ppm";
+}
+
+double elapsed_ms(clock_type::time_point since) {
+    return chrono::duration<double, milli>(clock_type::now() - since).count();
+}
+
+// model matrix that fits the model in a unit sphere, turned along the path
+mat4 model_matrix(const vertex_stream& vs, int frame, int frames) {
+    col3 lo, hi;
+    for(size_t i = 0; i < 3; i++) {
+        lo[i] = *min_element(vs.position[i].begin(), vs.position[i].end());
+        hi[i] = *max_element(vs.position[i].begin(), vs.position[i].end());
+    }
+
+    col3 center = (lo + hi) * 0.5;
+    double s = 2 / norm(hi - lo);
+
+    return tf::rotate(2 * math::PI * frame / frames, tf::zOx) *
+        tf::scale(s, s, s) *
+        tf::translate(col4 { -center[0], -center[1], -center[2], 1 });
+}
+
+int main(int argc, char* argv[])
+{
+    string model_path = argc > 1 ? argv[1] : "../models/teapot.obj";
+    int frames = argc > 2 ? atoi(argv[2]) : 100;
+    string output_path = argc > 3 ? argv[3] : "";
+    string texture_path = argc > 4 ? argv[4] : default_texture(model_path);
+    GUARD_(frames > 0);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // presets
+    ifstream fobj(model_path);
+    GUARD_(fobj.good());
+    vector<mesh_indexed> meshes = mesh_io_object::load(fobj);
+    GUARD_(!meshes.empty());
+
+    ifstream ftex(texture_path, ios::binary);
+    GUARD_(ftex.good());
+    image img = image_io_netpbm::load(ftex);
+    img.make_mipmaps(layout_tiled, format_rgba8);
+
+    indexed_stream input = indexed_stream::from_mesh(meshes.front());
+
+    const int width = 800, height = 600;
+
+    constants cnst;
+    cnst.viewport_w = width;
+    cnst.viewport_h = height;
+
+    surface_program<float> prog;
+    fsurface_uniforms& uniforms = prog.uniforms;
+    uniforms.texture = &img;
+    uniforms.light_pos = col4 { 0, 5, 3, 1 };
+    uniforms.camera_pos = col4 { 0, -0.25, 3, 1 };
+
+    mat4 view_mat =
+        tf::translate(col4 {
+                -uniforms.camera_pos[0],
+                -uniforms.camera_pos[1],
+                -uniforms.camera_pos[2], 1 }) *
+        tf::rotate(-math::PI / 6, tf::yOz);
+    mat4 proj_mat = tf::perspective(math::PI / 6, 4.0 / 3, 1, 100);
+
+    auto set_frame = [&](int f) {
+        mat4 model_mat = model_matrix(input.vertices, f, frames);
+        uniforms.mvp_matrix = proj_mat * view_mat * model_mat;
+        uniforms.m_matrix = model_mat;
+        uniforms.m_matrix_inv_t = transpose(inverse(model_mat));
+    };
+
+    framebuffer fb(width, height);
+    cnst.target = &fb;
+
+    vector<uint32_t> pixels(width * height);
+
+    cout << model_path << ": " << input.vertices.size() << " vertices, "
+        << input.indices.size() / 3 << " triangles, " << frames
+        << " frames at " << width << "x" << height << ", "
+        << omp_get_max_threads() << " threads" << endl;
+
+    ////////////////////////////////////////////////////////////////////////////
+    // sequential pass
+    vector<fvertex_out> vertex_output;
+    vector<uint32_t> index_output;
+    tile_bins bins;
+    double stage_ms[stage_count] = { };
+    cull_stats culled;
+
+    auto seq_begin = clock_type::now();
+    for(int f = 0; f < frames; f++) {
+        set_frame(f);
+        bool deferred = cnst.shading == shading_deferred;
+        clock_type::time_point t;
+
+        t = clock_type::now();
+        vertex_transformation(prog, input.vertices, vertex_output);
+        stage_ms[stage_transform] += elapsed_ms(t);
+
+        t = clock_type::now();
+        clip_primitives(vertex_output, input.indices, cnst, index_output);
+        stage_ms[stage_clip] += elapsed_ms(t);
+
+        t = clock_type::now();
+        assemble_primitives(vertex_output, index_output, cnst, bins);
+        stage_ms[stage_assemble] += elapsed_ms(t);
+        culled += bins.stats;
+
+        t = clock_type::now();
+        fb.defer_clear(color(0xff333333u), 1, deferred);
+        rasterize_tiles(prog, vertex_output, cnst, bins);
+        stage_ms[stage_raster] += elapsed_ms(t);
+
+        t = clock_type::now();
+        if(deferred)
+            shade_visibility(prog, vertex_output, index_output, cnst, bins);
+        stage_ms[stage_shade] += elapsed_ms(t);
+
+        t = clock_type::now();
+        fb.present(pixels.data(), width);
+        stage_ms[stage_present] += elapsed_ms(t);
+    }
+    double seq_ms = elapsed_ms(seq_begin);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // pipelined pass
+    double pipe_ms;
+    {
+        frame_pipeline<surface_program<float>> pipeline(input, cnst);
+
+        auto pipe_begin = clock_type::now();
+        for(int f = 0; f <= frames; f++) {
+            // one more submission drains the last frame
+            set_frame(f % frames);
+            pipeline.submit(prog, pixels.data(), width);
+        }
+        pipe_ms = elapsed_ms(pipe_begin);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // report
+    cout << fixed << setprecision(3);
+    for(int s = 0; s < stage_count; s++)
+        cout << setw(12) << stage_names[s] << setw(12)
+            << stage_ms[s] / frames << " ms/frame" << endl;
+
+    cout << setw(12) << "culled";
+    const char* reason_names[cull_reason_count] = {
+        "drawn", "backface", "degenerate", "offscreen", "no_samples" };
+    for(int r = 0; r < cull_reason_count; r++)
+        cout << " " << reason_names[r] << "=" << culled.counts[r] / frames;
+    cout << " per frame" << endl;
+
+    cout << setprecision(1)
+        << setw(12) << "sequential" << setw(12) << frames * 1000 / seq_ms
+        << " fps" << endl
+        << setw(12) << "pipelined" << setw(12) << frames * 1000 / pipe_ms
+        << " fps" << endl;
+
+    // zones of both passes, with SHRTOOL_PROFILE set
+    if(profiler::enabled())
+        profiler::report();
+
+    if(!output_path.empty()) {
+        image out;
+        out.resize(width, height);
+        for(int y = 0; y < height; y++)
+        for(int x = 0; x < width; x++) {
+            color c(pixels[y * width + x]);
+            swap(c.data.channels.r, c.data.channels.b);
+            out.pixel(x, y) = c;
+        }
+
+        ofstream fout(output_path, ios::binary);
+        image_io_netpbm::save_image(fout, out);
+    }
+}
@@ -3,6 +3,7 @@
  */
 
 #pragma OPENCL EXTENSION cl_khr_int64_base_atomics: enable
+#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics: enable
 
 #define swap_(t, a, b) { t temp = a; a = b; b = temp; }
 
@@ -18,9 +19,54 @@
 #define BS_WIDTH    0
 #define BS_HEIGHT   1
 
+#define RS_SIZE     0
+#define RS_CAPACITY 1
+
+#define TILE_SIZE   16
+
 typedef float4 pos_t;
 typedef float4 inf_t;
 
+/*
+ * Fragments are packed in 16 bytes: x | y << 16, bits of the float depth, the
+ * triangle, and the barycentric weights of its first two vertices as halves,
+ * the third being what remains of 1. Depths are in [0, 1], and -0 is stored
+ * as +0 so that their bits compare as ints.
+ */
+typedef uint4 frag_t;
+
+frag_t pack_fragment(
+        pos_t pos,
+        uint triangle_id,
+        float3 weight)
+{
+    uint halves;
+    vstore_half2_rte(weight.xy, 0, (half*)&halves);
+
+    return (frag_t)(
+        (uint)pos.x | (uint)pos.y << 16,
+        as_uint(pos.z) & 0x7fffffff,
+        triangle_id,
+        halves);
+}
+
+size_t fragment_coord(
+        frag_t frag,
+        in uint* gclBufferSize)
+{
+    return (frag.x >> 16) * (size_t)gclBufferSize[BS_WIDTH] + (frag.x & 0xffff);
+}
+
+float fragment_depth(frag_t frag) { return as_float(frag.y); }
+uint fragment_triangle(frag_t frag) { return frag.z; }
+
+float3 fragment_weight(frag_t frag)
+{
+    uint halves = frag.w;
+    float2 w = vload_half2(0, (const half*)&halves);
+    return (float3)(w, 1 - w.x - w.y);
+}
+
 /*
  * Output indices ensure triangles is sorted in ascending order of y,x.
  */
@@ -65,10 +111,8 @@ void extract_quad(
         inf_t quad_inf[4],
         inf_t quad_pos[4])
 {
-    size_t item_id = get_global_id(0);
-
     for(int i = 0; i < 4; i++)
-        quad_inf[i] = (float4)(0, 0, 0, item_id);
+        quad_inf[i] = (float4)(0);
 
     inf_t comp_min = identity_dim(idx[0]),
           comp_mid = identity_dim(idx[1]),
@@ -122,37 +166,69 @@ void extract_quad(
     } \
 }
 
-int is_in_viewport(
-        pos_t* point,
-        in float* gclViewport)
+/*
+ * Range [lo, hi) of the fragments of a span that fall in the viewport, in
+ * pixels from the beginning of the span. Depth is linear along a span, so the
+ * range is solved for rather than tested fragment by fragment. It's empty when
+ * hi <= lo.
+ */
+
+void clip_span(
+        pos_t beg,
+        pos_t end,
+        in float* gclViewport,
+        float* lo,
+        float* hi)
 {
-    if(point->x < gclViewport[VP_LEFT] ||
-       point->x > gclViewport[VP_LEFT] + gclViewport[VP_WIDTH]) return 0;
-    if(point->y < gclViewport[VP_TOP] ||
-       point->y > gclViewport[VP_TOP] + gclViewport[VP_HEIGHT]) return 0;
-    if(point->z < 0 ||
-       point->z > 1) return 0;
-
-    return 1;
+    float len = end.x - beg.x;
+    *lo = 0;
+    *hi = len;
+
+    if(beg.y < gclViewport[VP_TOP] ||
+       beg.y >= gclViewport[VP_TOP] + gclViewport[VP_HEIGHT]) {
+        *hi = 0;
+        return;
+    }
+
+    *lo = fmax(*lo, gclViewport[VP_LEFT] - beg.x);
+    *hi = fmin(*hi, gclViewport[VP_LEFT] + gclViewport[VP_WIDTH] - beg.x);
+    if(len <= 0) return;
+
+    float dz = (end.z - beg.z) / len;
+    if(dz > 0) {
+        *lo = fmax(*lo, ceil(-beg.z / dz));
+        *hi = fmin(*hi, floor((1 - beg.z) / dz) + 1);
+    } else if(dz < 0) {
+        *lo = fmax(*lo, ceil((1 - beg.z) / dz));
+        *hi = fmin(*hi, floor(-beg.z / dz) + 1);
+    } else if(beg.z < 0 || beg.z > 1)
+        *hi = 0;
 }
 
-kernel void mark_scanline(
-        in      pos_t*  InterpPosition,
-        in      float*  gclViewport,
-        inout   uint*   gclMarkSize,
-        inout   uint*   gclFragmentSize,
-        out     pos_t*  gclMarkPos,
-        out     inf_t*  gclMarkInfo)
+uint span_size(
+        pos_t beg,
+        pos_t end,
+        in float* gclViewport)
 {
-    size_t item_id = get_global_id(0) * 3;
+    float lo, hi;
+    clip_span(beg, end, gclViewport, &lo, &hi);
+    return hi > lo ? (uint)(hi - lo) : 0;
+}
 
-    pos_t triangle[3] = {
-        InterpPosition[item_id],
-        InterpPosition[item_id + 1],
-        InterpPosition[item_id + 2],
-    };
+/*
+ * Transforms a triangle into the viewport.
+ */
+
+void viewport_triangle(
+        in pos_t* InterpPosition,
+        in float* gclViewport,
+        size_t triangle_id,
+        pos_t triangle[3])
+{
+    InterpPosition += triangle_id * 3;
 
     for(int i = 0; i < 3; i++) {
+        triangle[i] = InterpPosition[i];
         triangle[i] /= fabs(triangle[i].w);
         triangle[i].x *= gclViewport[VP_WIDTH] / 2;
         triangle[i].x += gclViewport[VP_LEFT] + gclViewport[VP_WIDTH] / 2;
@@ -162,43 +238,246 @@ kernel void mark_scanline(
         triangle[i].z += 0.5;
         triangle[i].w = 1;
     }
+}
+
+/*
+ * Transforms the triangle of this item into the viewport and splits it into a
+ * quad, whose rows are floored to scanlines.
+ */
+
+void setup_triangle(
+        in pos_t* InterpPosition,
+        in float* gclViewport,
+        inf_t quad_inf[4],
+        pos_t quad_pos[4])
+{
+    pos_t triangle[3];
+    viewport_triangle(InterpPosition, gclViewport, get_global_id(0), triangle);
 
     size_t idx[3];
     sort_triangle(triangle, idx);
 
-    inf_t quad_inf[4]; 
-    pos_t quad_pos[4];
     extract_quad(triangle, idx, quad_inf, quad_pos);
     for(int i = 0; i < 4; i++)
         quad_pos[i].y = floor(quad_pos[i].y);
+}
+
+/*
+ * Work-efficient exclusive scan (Blelloch) of the n elements in temp, n being
+ * twice the local size and a power of two. Returns the sum of all of them.
+ * Every item of the work-group must call it.
+ */
+
+uint local_scan(
+        __local uint* temp,
+        size_t n)
+{
+    size_t local_id = get_local_id(0);
+    size_t offset = 1;
+
+    for(size_t d = n >> 1; d > 0; d >>= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if(local_id < d) {
+            size_t a = offset * (2 * local_id + 1) - 1;
+            size_t b = offset * (2 * local_id + 2) - 1;
+            temp[b] += temp[a];
+        }
+        offset <<= 1;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    uint total = temp[n - 1];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(local_id == 0) temp[n - 1] = 0;
+
+    for(size_t d = 1; d < n; d <<= 1) {
+        offset >>= 1;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if(local_id < d) {
+            size_t a = offset * (2 * local_id + 1) - 1;
+            size_t b = offset * (2 * local_id + 2) - 1;
+            uint t = temp[a];
+            temp[a] = temp[b];
+            temp[b] += t;
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return total;
+}
+
+/*
+ * Reserves count elements for each item of the work-group from the counter
+ * gclReserve[RS_SIZE], with a single atomic for the whole group, and returns
+ * the first of them. Items keep their order within the group. temp holds twice
+ * the local size of uints. Every item of the work-group must call it.
+ */
+
+size_t reserve_group(
+        inout   uint*   gclReserve,
+        __local uint*   temp,
+        uint count)
+{
+    size_t local_id = get_local_id(0),
+           n = get_local_size(0) * 2;
+
+    temp[local_id] = count;
+    temp[local_id + n / 2] = 0;
+
+    uint total = local_scan(temp, n);
+    uint offset = temp[local_id];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(local_id == 0)
+        temp[0] = atomic_add(gclReserve + RS_SIZE, total);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return temp[0] + offset;
+}
+
+/*
+ * Exclusive scan of gclScanData in place. Each work-group scans twice its local
+ * size of elements, so temp holds as many uints, and the sum of each group is
+ * written to gclScanBlock. Unless one group covers all of them, gclScanBlock is
+ * scanned in turn the same way, and scan_add is then run on the same range to
+ * add the offsets of the groups. gclScanBlock is NULL for the last level.
+ */
+
+kernel void scan_block(
+        inout   uint*   gclScanData,
+        out     uint*   gclScanBlock,
+        __local uint*   temp,
+        const   uint    size)
+{
+    size_t local_id = get_local_id(0),
+           n = get_local_size(0) * 2,
+           beg = get_group_id(0) * n;
+
+    for(size_t i = local_id; i < n; i += n / 2)
+        temp[i] = beg + i < size ? gclScanData[beg + i] : 0;
+
+    uint total = local_scan(temp, n);
+
+    for(size_t i = local_id; i < n; i += n / 2)
+        if(beg + i < size) gclScanData[beg + i] = temp[i];
+
+    if(gclScanBlock != NULL && local_id == 0)
+        gclScanBlock[get_group_id(0)] = total;
+}
+
+kernel void scan_add(
+        inout   uint*   gclScanData,
+        in      uint*   gclScanBlock,
+        const   uint    size)
+{
+    size_t local_id = get_local_id(0),
+           n = get_local_size(0) * 2,
+           beg = get_group_id(0) * n;
+
+    for(size_t i = local_id; i < n; i += n / 2)
+        if(beg + i < size) gclScanData[beg + i] += gclScanBlock[get_group_id(0)];
+}
+
+/*
+ * Triangles are expanded into spans and spans into fragments with no atomic
+ * counter, and every output has a place that doesn't depend on scheduling:
+ *
+ *  1. count_scanline writes the number of spans of each triangle to
+ *     gclMarkOffset, which has one more element, set to 0 by the host.
+ *  2. gclMarkOffset is scanned, and becomes the first span of each triangle.
+ *     Its last element is then the number of spans.
+ *  3. mark_scanline writes the spans at these offsets, and the number of
+ *     fragments of each span to gclFragOffset, again with a trailing 0.
+ *  4. gclFragOffset is scanned likewise, and its last element is then the
+ *     number of fragments.
+ *  5. fill_scanline writes the fragments of each span at these offsets.
+ *
+ * Spans out of the viewport are kept but have no fragments, so that a span
+ * count is known before interpolating anything.
+ *
+ * Alternatively, with gclMarkOffset or gclFragOffset being NULL, the step that
+ * would read it reserves its outputs from gclMarkSize or gclFragmentSize, one
+ * atomic per work-group, which saves the counting and scanning before it. The
+ * order of outputs then depends on scheduling, and the host has to guess a
+ * capacity for them, in the RS_CAPACITY element of the counter. Outputs beyond
+ * it are dropped, but RS_SIZE still counts them, so the host can grow the
+ * buffers and run it again. In either case the global size may be rounded up
+ * to the local size, with size being the actual number of items.
+ */
+
+kernel void count_scanline(
+        in      pos_t*  InterpPosition,
+        in      float*  gclViewport,
+        const   uint    size,
+        out     uint*   gclMarkOffset)
+{
+    if(get_global_id(0) >= size) return;
+
+    inf_t quad_inf[4];
+    pos_t quad_pos[4];
+    setup_triangle(InterpPosition, gclViewport, quad_inf, quad_pos);
 
     size_t y_1 = quad_pos[1].y - quad_pos[0].y;
     size_t y_2 = quad_pos[3].y - quad_pos[2].y;
 
-    if(gclMarkInfo == NULL || gclMarkPos == NULL || gclFragmentSize == NULL) {
-        size_t y = y_1 + y_2;
-        if(y > gclViewport[VP_HEIGHT]) y = gclViewport[VP_HEIGHT];
-        atomic_add(gclMarkSize, (y_1 + y_2) * 2);
-        return;
+    gclMarkOffset[get_global_id(0)] = y_1 + y_2;
+}
+
+kernel void mark_scanline(
+        in      pos_t*  InterpPosition,
+        in      float*  gclViewport,
+        in      uint*   gclMarkOffset,
+        inout   uint*   gclMarkSize,
+        __local uint*   temp,
+        const   uint    size,
+        out     pos_t*  gclMarkPos,
+        out     inf_t*  gclMarkInfo,
+        out     uint*   gclMarkTriangle,
+        out     uint*   gclFragOffset)
+{
+    size_t item_id = get_global_id(0);
+
+    inf_t quad_inf[4];
+    pos_t quad_pos[4];
+    size_t y_1 = 0, y_2 = 0;
+
+    if(item_id < size) {
+        setup_triangle(InterpPosition, gclViewport, quad_inf, quad_pos);
+        y_1 = quad_pos[1].y - quad_pos[0].y;
+        y_2 = quad_pos[3].y - quad_pos[2].y;
     }
 
+    size_t old, capacity;
+
+    if(gclMarkOffset == NULL) {
+        old = reserve_group(gclMarkSize, temp, y_1 + y_2) * 2;
+        capacity = gclMarkSize[RS_CAPACITY] * 2;
+    } else {
+        old = item_id < size ? gclMarkOffset[item_id] * 2 : 0;
+        capacity = old + (y_1 + y_2) * 2;
+    }
+
+    if(item_id >= size) return;
+
     float4 beg_1[4] = { quad_inf[0], quad_inf[0], quad_pos[0], quad_pos[0], },
            end_1[4] = { quad_inf[1], quad_inf[2], quad_pos[1], quad_pos[2], },
            beg_2[4] = { quad_inf[1], quad_inf[2], quad_pos[1], quad_pos[2], },
            end_2[4] = { quad_inf[3], quad_inf[3], quad_pos[3], quad_pos[3], };
 
 #define scanline_interpolate_func(data, sz) { \
-    if(is_in_viewport(&data[2], gclViewport) || \
-       is_in_viewport(&data[3], gclViewport)) { \
-        size_t old = atomic_add(gclMarkSize, 2); \
+    if(old < capacity) { \
+        pos_t span_beg = round(data[2]), span_end = round(data[3]); \
+        span_beg.z = data[2].z; \
+        span_end.z = data[3].z; \
         gclMarkInfo[old + 0] = data[0]; \
         gclMarkInfo[old + 1] = data[1]; \
-        gclMarkPos[old + 0] = round(data[2]); \
-        gclMarkPos[old + 1] = round(data[3]); \
-        gclMarkPos[old + 0].z = data[2].z; \
-        gclMarkPos[old + 1].z = data[3].z; \
-        atomic_add(gclFragmentSize, gclMarkPos[old+1].x - gclMarkPos[old].x); \
+        gclMarkPos[old + 0] = span_beg; \
+        gclMarkPos[old + 1] = span_end; \
+        gclMarkTriangle[old / 2] = item_id; \
+        if(gclFragOffset != NULL) gclFragOffset[old / 2] = \
+            span_size(span_beg, span_end, gclViewport); \
     } \
+    old += 2; \
 }
 
     interpolate_segment(float4, y_1, 4, beg_1, end_1,
@@ -210,10 +489,13 @@ kernel void mark_scanline(
 kernel void fill_scanline(
         in      pos_t*  gclMarkPos,
         in      inf_t*  gclMarkInfo,
+        in      uint*   gclMarkTriangle,
         in      float*  gclViewport,
+        in      uint*   gclFragOffset,
         inout   uint*   gclFragmentSize,
-        out     pos_t*  gclFragPos,
-        out     inf_t*  gclFragInfo)
+        __local uint*   temp,
+        const   uint    size,
+        out     frag_t* gclFragment)
 {
     size_t item_id = get_global_id(0),
            mark_id = item_id * 2;
@@ -221,48 +503,282 @@ kernel void fill_scanline(
     gclMarkPos  += mark_id;
     gclMarkInfo += mark_id;
 
-    size_t len = gclMarkPos[1].x - gclMarkPos[0].x;
+    float lo = 0, hi = 0;
+    if(item_id < size)
+        clip_span(gclMarkPos[0], gclMarkPos[1], gclViewport, &lo, &hi);
+
+    // fragments written are those reserved, not recomputed from clip_span
+    size_t old = 0, count = hi > lo ? (uint)(hi - lo) : 0;
+    if(gclFragOffset == NULL) {
+        old = reserve_group(gclFragmentSize, temp, (uint)count);
+        size_t capacity = gclFragmentSize[RS_CAPACITY];
+        count = old < capacity ? min(count, capacity - old) : 0;
+    } else if(item_id < size) {
+        old = gclFragOffset[item_id];
+        count = gclFragOffset[item_id + 1] - old;
+    }
+    hi = fmin(hi, lo + count);
+
+    if(item_id >= size) return;
+
+    float len = gclMarkPos[1].x - gclMarkPos[0].x;
+    pos_t diff_pos = (gclMarkPos[1] - gclMarkPos[0]) / len;
+    inf_t diff_inf = (gclMarkInfo[1] - gclMarkInfo[0]) / len;
+
+    for(float l = lo; l < hi; l += 1.f, old++) {
+        pos_t pos = gclMarkPos[0] + l * diff_pos;
+        pos.z = clamp(pos.z, 0.f, 1.f);
+        inf_t inf = gclMarkInfo[0] + l * diff_inf;
+        gclFragment[old] = pack_fragment(pos, gclMarkTriangle[item_id], inf.xyz);
+    }
+}
+
+/*
+ * Sort-middle alternative to expanding scanlines, which tests depth in place
+ * and never writes fragments out, so that memory traffic scales with the
+ * screen rather than with overdraw:
+ *
+ *  1. bin_triangle appends each triangle to the queue of every tile of
+ *     TILE_SIZE square pixels that its bounding box overlaps. gclTileSize
+ *     has a counter per tile, zeroed by the host, and gclTileQueue capacity
+ *     elements per tile. A counter above capacity means that its tile
+ *     overflowed, and that the host has to grow capacity and bin again.
+ *  2. raster_tile runs a work-group per tile, with an item per pixel. The
+ *     group sets up the triangles of its queue a chunk at a time in local
+ *     memory, and each item keeps the nearest of them in private memory
+ *     before writing its pixel once.
+ *
+ * Tiles are numbered row by row from the corner of the viewport, and
+ * raster_tile is run with a global size of the tiles in pixels and a local
+ * size of TILE_SIZE by TILE_SIZE.
+ *
+ * As with depth_test, gclDepthBuffer holds the bits of float depths compared
+ * as ints, which orders them right since depths are in [0, 1]. The host
+ * clears it to INT_MAX, or to the bits of 1.0f, farther than any fragment.
+ */
+
+kernel void bin_triangle(
+        in      pos_t*  InterpPosition,
+        in      float*  gclViewport,
+        inout   uint*   gclTileSize,
+        out     uint*   gclTileQueue,
+        const   uint    capacity)
+{
+    size_t item_id = get_global_id(0);
+
+    pos_t triangle[3];
+    viewport_triangle(InterpPosition, gclViewport, item_id, triangle);
+
+    pos_t lo = fmin(fmin(triangle[0], triangle[1]), triangle[2]),
+          hi = fmax(fmax(triangle[0], triangle[1]), triangle[2]);
+    if(lo.z > 1 || hi.z < 0) return;
+
+    float tiles_x = ceil(gclViewport[VP_WIDTH] / TILE_SIZE),
+          tiles_y = ceil(gclViewport[VP_HEIGHT] / TILE_SIZE);
+
+    float tile_x_0 = floor((lo.x - gclViewport[VP_LEFT]) / TILE_SIZE),
+          tile_y_0 = floor((lo.y - gclViewport[VP_TOP]) / TILE_SIZE),
+          tile_x_1 = floor((hi.x - gclViewport[VP_LEFT]) / TILE_SIZE),
+          tile_y_1 = floor((hi.y - gclViewport[VP_TOP]) / TILE_SIZE);
+
+    // vertices near the camera are far out of the range of int, and are
+    // clamped while still floats; NaN bounds fail these tests as well
+    if(!(tile_x_0 <= tiles_x - 1 && tile_y_0 <= tiles_y - 1 &&
+         tile_x_1 >= 0 && tile_y_1 >= 0)) return;
+
+    int x_0 = clamp(tile_x_0, 0.f, tiles_x - 1),
+        y_0 = clamp(tile_y_0, 0.f, tiles_y - 1),
+        x_1 = clamp(tile_x_1, 0.f, tiles_x - 1),
+        y_1 = clamp(tile_y_1, 0.f, tiles_y - 1);
+
+    for(int y = y_0; y <= y_1; y++)
+    for(int x = x_0; x <= x_1; x++) {
+        size_t tile = y * (size_t)tiles_x + x;
+        uint slot = atomic_inc(gclTileSize + tile);
+        if(slot < capacity)
+            gclTileQueue[tile * capacity + slot] = item_id;
+    }
+}
 
-    if(gclFragPos == NULL || gclFragInfo == NULL) {
-        atomic_add(gclFragmentSize, len);
+/*
+ * Edge functions of a triangle, scaled by its area so that they are its
+ * barycentric coordinates: edges[i].xyz is (a, b, c) of the weight of vertex
+ * i, a * x + b * y + c, and edges[3] is that of depth. Degenerate triangles
+ * cover no pixel.
+ */
+
+void setup_edges(
+        in pos_t* InterpPosition,
+        in float* gclViewport,
+        uint triangle_id,
+        __local float4* edges)
+{
+    pos_t v[3];
+    viewport_triangle(InterpPosition, gclViewport, triangle_id, v);
+
+    float area =
+        (v[1].x - v[0].x) * (v[2].y - v[0].y) -
+        (v[2].x - v[0].x) * (v[1].y - v[0].y);
+
+    if(area == 0 || !isfinite(area)) {
+        for(int i = 0; i < 4; i++)
+            edges[i] = (float4)(0, 0, -1, 0);
         return;
     }
 
-    float4 beg[2] = { gclMarkPos[0], gclMarkInfo[0] };
-    float4 end[2] = { gclMarkPos[1], gclMarkInfo[1] };
+    float4 depth = 0;
+    for(int i = 0; i < 3; i++) {
+        pos_t j = v[(i + 1) % 3], k = v[(i + 2) % 3];
+        float dx = k.x - j.x, dy = k.y - j.y;
 
-#define fragment_interpolate_func(data, sz) { \
-    if(is_in_viewport(&data[0], gclViewport)) { \
-        size_t old = atomic_inc(gclFragmentSize); \
-        gclFragPos[old] = data[0]; \
-        gclFragInfo[old] = data[1]; \
-    } \
+        edges[i] = (float4)(-dy, dx, dy * j.x - dx * j.y, 0) / area;
+        depth += edges[i] * v[i].z;
+    }
+
+    edges[3] = depth;
 }
 
-    interpolate_segment(float4, len, 2, beg, end,
-            fragment_interpolate_func);
+kernel void raster_tile(
+        in      pos_t*  InterpPosition,
+        in      float*  gclViewport,
+        in      uint*   gclBufferSize,
+        in      uint*   gclTileSize,
+        in      uint*   gclTileQueue,
+        const   uint    capacity,
+        __local float4* edges,
+        __local uint*   ids,
+        inout   int*    gclDepthBuffer,
+        out     frag_t* gclPixelFragment)
+{
+    size_t n = TILE_SIZE * TILE_SIZE,
+           local_id = get_local_id(1) * TILE_SIZE + get_local_id(0),
+           tile = get_group_id(1) * get_num_groups(0) + get_group_id(0);
+
+    float x = gclViewport[VP_LEFT] + get_global_id(0),
+          y = gclViewport[VP_TOP] + get_global_id(1);
+    float2 center = (float2)(x + 0.5f, y + 0.5f);
+
+    int inside =
+        x < gclViewport[VP_LEFT] + gclViewport[VP_WIDTH] &&
+        y < gclViewport[VP_TOP] + gclViewport[VP_HEIGHT];
+    size_t coord = (size_t)y * gclBufferSize[BS_WIDTH] + (size_t)x;
+
+    int depth = inside ? gclDepthBuffer[coord] : INT_MIN;
+    uint winner = 0;
+    int written = 0;
+    float3 weight;
+
+    uint size = min(gclTileSize[tile], capacity);
+    gclTileQueue += tile * capacity;
+
+    for(uint beg = 0; beg < size; beg += n) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if(beg + local_id < size) {
+            ids[local_id] = gclTileQueue[beg + local_id];
+            setup_edges(InterpPosition, gclViewport, ids[local_id],
+                edges + local_id * 4);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        uint chunk = min(size - beg, (uint)n);
+        for(uint i = 0; i < chunk; i++) {
+            __local float4* e = edges + i * 4;
+            float3 w = (float3)(
+                dot(e[0].xy, center) + e[0].z,
+                dot(e[1].xy, center) + e[1].z,
+                dot(e[2].xy, center) + e[2].z);
+            if(w.x < 0 || w.y < 0 || w.z < 0) continue;
+
+            float z = dot(e[3].xy, center) + e[3].z;
+            if(!(z >= 0 && z <= 1)) continue;
+
+            // -0 is cleared to +0, and ties go to the lower id, whatever the
+            // order of the queue
+            int bits = as_int(z) & INT_MAX;
+            if(bits < depth || (bits == depth && written && ids[i] < winner)) {
+                depth = bits;
+                winner = ids[i];
+                written = 1;
+                weight = w;
+            }
+        }
+    }
+
+    if(inside && written) {
+        gclDepthBuffer[coord] = depth;
+        gclPixelFragment[coord] = pack_fragment(
+            (pos_t)(x, y, as_float(depth), 1), winner, weight);
+    }
 }
 
 kernel void depth_test(
-        in      pos_t* gclFragPos,
-        in      uint*  gclBufferSize,
-        inout   int*   gclDepthBuffer)
+        in      frag_t* gclFragment,
+        in      uint*   gclBufferSize,
+        inout   int*    gclDepthBuffer)
 {
     size_t item_id = get_global_id(0);
-    gclFragPos += item_id;
+    frag_t frag = gclFragment[item_id];
 
-    size_t coord =
-        (size_t)gclFragPos->y * gclBufferSize[BS_WIDTH] +
-        (size_t)gclFragPos->x;
-    gclDepthBuffer += coord;
+    gclDepthBuffer += fragment_coord(frag, gclBufferSize);
 
-    //int integral_z = round(gclFragPos->z * (1 << 24));
-    float floating_z = gclFragPos->z;
+    //int integral_z = round(fragment_depth(frag) * (1 << 24));
+    float floating_z = fragment_depth(frag);
     int integral_z = *(int*)&floating_z;
 
     atomic_min(gclDepthBuffer, integral_z);
 }
 
+/*
+ * Visibility alternative to depth_test, that finds which fragment won and not
+ * only its depth:
+ *
+ *  1. depth_test_visibility packs the depth of each fragment above its index
+ *     in gclFragment, and keeps the least of them per pixel with one 64-bit
+ *     atom_min, so that the nearest fragment wins and ties go to the first.
+ *     Fragments behind gclDepthBuffer, left by earlier draws, are dropped.
+ *     Indices take the low 32 bits, so a draw has fewer than 2^32 fragments.
+ *     Depths are compared as int bits, where -0 would sort after every
+ *     other depth, which is why pack_fragment never stores it.
+ *  2. resolve_visibility runs an item per pixel of the buffer, copies the
+ *     winner to gclPixelFragment and its depth to gclDepthBuffer, and resets
+ *     gclVisibility to all ones, which is also how the host clears it first.
+ *
+ * A shading kernel then reads gclPixelFragment, as it does after raster_tile,
+ * and shades one fragment per pixel, never an occluded one.
+ */
+
+kernel void depth_test_visibility(
+        in      frag_t* gclFragment,
+        in      uint*   gclBufferSize,
+        in      int*    gclDepthBuffer,
+        inout   ulong*  gclVisibility)
+{
+    size_t item_id = get_global_id(0);
+    frag_t frag = gclFragment[item_id];
+    size_t coord = fragment_coord(frag, gclBufferSize);
+
+    // depths are positive, so their bits compare as integers do
+    if((int)frag.y >= gclDepthBuffer[coord]) return;
+
+    atom_min(gclVisibility + coord, (ulong)frag.y << 32 | (uint)item_id);
+}
+
+kernel void resolve_visibility(
+        in      frag_t* gclFragment,
+        inout   ulong*  gclVisibility,
+        inout   int*    gclDepthBuffer,
+        out     frag_t* gclPixelFragment)
+{
+    size_t coord = get_global_id(0);
+    ulong key = gclVisibility[coord];
+    if(key == ULONG_MAX) return;
+
+    frag_t frag = gclFragment[(uint)key];
+    gclDepthBuffer[coord] = frag.y;
+    gclPixelFragment[coord] = frag;
+    gclVisibility[coord] = ULONG_MAX;
+}
+
 kernel void adapt_pixel(
         in      float4* gclColorBuffer,
         in      float*  gclViewport,